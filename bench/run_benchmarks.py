@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""
+Measures what the plugin costs. Generates synthetic stress TUs, compiles each
+of them with and without -fplugin=externis a few times, and reports the median
+wall time, the peak RSS of the compiler and the size of the trace.
+"""
+import argparse
+import json
+import os
+import shlex
+import statistics
+import subprocess
+import sys
+import time
+
+
+def generate_deep_includes(directory, scale):
+    """A tree of headers with include guards, and a long include chain."""
+    # GCC's default -fmax-include-depth is 200.
+    fan_out, depth, chain = 4, 6, min(round(150 * scale), 190)
+    headers = os.path.join(directory, 'deep_includes')
+    os.makedirs(headers, exist_ok=True)
+
+    def write_header(name, includes, body):
+        with open(os.path.join(headers, name), 'w') as f:
+            guard = name.replace('.', '_').upper()
+            f.write(f'#ifndef {guard}\n#define {guard}\n')
+            for include in includes:
+                f.write(f'#include "{include}"\n')
+            f.write(body)
+            f.write('#endif\n')
+
+    def tree(path, level):
+        name = f'tree{path}.h'
+        children = [tree(f'{path}_{i}', level + 1)
+                    for i in range(fan_out)] if level < depth else []
+        # Every header also includes the root of the chain, which is only
+        # lexed once thanks to its guard.
+        write_header(name, children + ['chain0.h'],
+                     f'struct S{path} {{ int x; }};\ninline int f{path}() {{ return {level}; }}\n')
+        return name
+
+    for i in range(chain):
+        write_header(f'chain{i}.h', [f'chain{i + 1}.h'] if i + 1 < chain else [],
+                     f'typedef int chain_t{i};\n')
+    return f'#include "deep_includes/{tree("", 0)}"\nint main() {{ return f(); }}\n'
+
+
+def generate_many_functions(directory, scale):
+    """Tens of thousands of small functions, a tenth of which are optimized."""
+    count = round(20000 * scale)
+    lines = [f'{"" if i % 10 == 0 else "static "}int f{i}(int x) '
+             f'{{ return x * {i % 7 + 1} + {i}; }}' for i in range(count)]
+    lines.append('int main() { return f0(1); }')
+    return '\n'.join(lines) + '\n'
+
+
+def generate_templates(directory, scale):
+    """Recursive instantiations and standard containers of many types."""
+    count = round(25 * scale)
+    lines = ['#include <algorithm>', '#include <map>', '#include <string>',
+             '#include <tuple>', '#include <vector>', '',
+             'template <int N> struct Fib {',
+             '  static constexpr long value = Fib<N - 1>::value + Fib<N - 2>::value;',
+             '};',
+             'template <> struct Fib<1> { static constexpr long value = 1; };',
+             'template <> struct Fib<0> { static constexpr long value = 0; };',
+             '',
+             'template <typename... Ts> auto sum(Ts... ts) { return (ts + ... + 0); }',
+             '']
+    for i in range(count):
+        lines.append(f'struct T{i} {{ int value = {i}; bool operator<(const T{i} &o) const '
+                     f'{{ return value < o.value; }} }};')
+        lines.append(f'long use{i}() {{ std::map<T{i}, std::vector<std::string>> m; '
+                     f'm[T{i}{{}}].push_back("x"); std::vector<T{i}> v(3); '
+                     f'std::sort(v.begin(), v.end()); '
+                     f'auto t = std::make_tuple(T{i}{{}}, {i}, "s"); '
+                     f'return m.size() + v.size() + std::get<1>(t) + '
+                     f'sum({i}, {i + 1}, {i + 2}) + Fib<{i % 80 + 10}>::value; }}')
+    lines.append('int main() { return use0() != 0; }')
+    return '\n'.join(lines) + '\n'
+
+
+def generate_namespaces(directory, scale):
+    """A huge namespace, reopened many times, with nested namespaces."""
+    count = round(20000 * scale)
+    lines = []
+    for i in range(count):
+        lines.append(f'namespace huge {{ namespace n{i % 100} {{ namespace inner{i} {{')
+        lines.append(f'struct C{i} {{ int f() const {{ return {i}; }} }};')
+        lines.append(f'inline int g{i}() {{ return C{i}{{}}.f(); }}')
+        lines.append('} } }')
+    lines.append('int main() { return huge::n0::inner0::g0(); }')
+    return '\n'.join(lines) + '\n'
+
+
+def generate_macros(directory, scale):
+    """Thousands of macros, nested expansions and token heavy bodies."""
+    count = round(5000 * scale)
+    lines = ['#define CAT_(a, b) a##b', '#define CAT(a, b) CAT_(a, b)',
+             '#define REPEAT2(x) x x', '#define REPEAT4(x) REPEAT2(x) REPEAT2(x)',
+             '#define REPEAT16(x) REPEAT4(REPEAT4(x))']
+    for i in range(count):
+        lines.append(f'#define M{i}(x) ((x) * {i} + CAT(v, {i % 10}))')
+    lines.append('static const int v0 = 0, v1 = 1, v2 = 2, v3 = 3, v4 = 4, v5 = 5, '
+                 'v6 = 6, v7 = 7, v8 = 8, v9 = 9;')
+    for i in range(0, count, 4):
+        lines.append(f'int e{i}() {{ return REPEAT16(M{i}(1) +) 0; }}')
+    lines.append('int main() { return e0(); }')
+    return '\n'.join(lines) + '\n'
+
+
+BENCHMARKS = {
+    'deep_includes': generate_deep_includes,
+    'many_functions': generate_many_functions,
+    'templates': generate_templates,
+    'namespaces': generate_namespaces,
+    'macros': generate_macros,
+}
+
+
+def run_once(command):
+    """Returns the wall time in seconds and the peak RSS in bytes."""
+    start = time.perf_counter()
+    process = subprocess.Popen(command, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    stderr = process.stderr.read()
+    # The rusage of the driver includes cc1, which it waited for.
+    _, status, rusage = os.wait4(process.pid, 0)
+    wall = time.perf_counter() - start
+    process.returncode = os.waitstatus_to_exitcode(status)
+    if process.returncode:
+        sys.stderr.write(stderr.decode(errors='replace'))
+        raise RuntimeError(f'{shlex.join(command)} failed')
+    return wall, rusage.ru_maxrss * 1024
+
+
+def measure(command, repeat):
+    runs = [run_once(command) for _ in range(repeat)]
+    return {
+        'wall_s': statistics.median(wall for wall, _ in runs),
+        'min_wall_s': min(wall for wall, _ in runs),
+        'rss_bytes': max(rss for _, rss in runs),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--compiler', default='g++')
+    parser.add_argument('--plugin', required=True, help='Path to externis.so')
+    parser.add_argument('--work-dir', required=True,
+                        help='Where the TUs, objects and traces are written')
+    parser.add_argument('--repeat', type=int, default=5)
+    parser.add_argument('--scale', type=float, default=1.0,
+                        help='Multiplies the size of every stress TU')
+    parser.add_argument('--flags', default='-O2', help='Flags for every compilation')
+    parser.add_argument('--plugin-arg', action='append', default=[],
+                        help='Extra -fplugin-arg-externis-ARG, e.g. format=perfetto')
+    parser.add_argument('--only', action='append', choices=sorted(BENCHMARKS),
+                        help='Only run these benchmarks')
+    parser.add_argument('--json', help='Also write the results to this file')
+    args = parser.parse_args()
+
+    os.makedirs(args.work_dir, exist_ok=True)
+    results = {}
+    for name in args.only or BENCHMARKS:
+        source = os.path.join(args.work_dir, f'{name}.cc')
+        with open(source, 'w') as f:
+            f.write(BENCHMARKS[name](args.work_dir, args.scale))
+        base = [args.compiler, *shlex.split(args.flags), '-c', source,
+                '-o', os.path.join(args.work_dir, f'{name}.o')]
+        trace = os.path.join(args.work_dir, f'{name}.trace')
+        traced = base + [f'-fplugin={args.plugin}',
+                         f'-fplugin-arg-externis-trace={trace}'] + [
+            f'-fplugin-arg-externis-{arg}' for arg in args.plugin_arg]
+
+        print(f'{name}: {args.repeat} runs each...', file=sys.stderr)
+        # One untimed run of each, so both start with warm caches.
+        run_once(base)
+        run_once(traced)
+        baseline = measure(base, args.repeat)
+        plugin = measure(traced, args.repeat)
+        plugin['trace_bytes'] = os.path.getsize(trace)
+        results[name] = {'baseline': baseline, 'externis': plugin}
+
+    print(f'{"benchmark":<16} {"base s":>8} {"plugin s":>9} {"wall":>8} '
+          f'{"base MB":>8} {"plugin MB":>10} {"RSS":>8} {"trace MB":>9}')
+    for name, result in results.items():
+        baseline, plugin = result['baseline'], result['externis']
+        print(f'{name:<16} {baseline["wall_s"]:8.3f} {plugin["wall_s"]:9.3f} '
+              f'{100 * (plugin["wall_s"] / baseline["wall_s"] - 1):+7.1f}% '
+              f'{baseline["rss_bytes"] / 2**20:8.1f} {plugin["rss_bytes"] / 2**20:10.1f} '
+              f'{100 * (plugin["rss_bytes"] / baseline["rss_bytes"] - 1):+7.1f}% '
+              f'{plugin["trace_bytes"] / 2**20:9.2f}')
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == '__main__':
+    main()
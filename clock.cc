@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "externis.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace externis {
+
+ClockSource clock_source = ClockSource::CHRONO;
+uint64_t clock_start = 0;
+uint64_t tsc_multiplier = 0;
+
+namespace {
+
+// Long enough that the error of the reference clock reads is negligible, and
+// short enough not to matter next to a compilation.
+constexpr TimeStamp TSC_CALIBRATION_NS = 2000000;
+TimeStamp tsc_calibration_ns = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+// Without an invariant TSC the tick rate changes with the CPU frequency.
+bool has_invariant_tsc() {
+  unsigned eax, ebx, ecx, edx;
+  return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8));
+}
+
+uint64_t read_tsc() { return __builtin_ia32_rdtsc(); }
+
+bool calibrate_tsc() {
+  if (!has_invariant_tsc()) {
+    return false;
+  }
+  TimeStamp start_ns = clock_ns(CLOCK_MONOTONIC_RAW);
+  uint64_t start_ticks = read_tsc();
+  TimeStamp end_ns;
+  do {
+    end_ns = clock_ns(CLOCK_MONOTONIC_RAW);
+  } while (end_ns - start_ns < TSC_CALIBRATION_NS);
+  uint64_t ticks = read_tsc() - start_ticks;
+  tsc_calibration_ns = end_ns - start_ns;
+  tsc_multiplier = (static_cast<unsigned __int128>(tsc_calibration_ns)
+                    << TSC_SHIFT) /
+                   ticks;
+  return tsc_multiplier != 0;
+}
+#else
+bool calibrate_tsc() { return false; }
+uint64_t read_tsc() { return 0; }
+#endif
+
+} // namespace
+
+bool set_clock_source(const char *name) {
+  // The new clock starts where the old one is now, so that timestamps taken
+  // since COMPILATION_START stay valid.
+  TimeStamp elapsed = ns_from_start();
+  if (!strcmp(name, "chrono")) {
+    clock_source = ClockSource::CHRONO;
+  } else if (!strcmp(name, "tsc")) {
+    if (!calibrate_tsc()) {
+      fprintf(stderr, "Externis warning: No invariant TSC, using the raw "
+                      "monotonic clock instead\n");
+      return set_clock_source("raw");
+    }
+    elapsed = ns_from_start();
+    clock_source = ClockSource::TSC;
+    clock_start = read_tsc() -
+                  (static_cast<unsigned __int128>(elapsed) << TSC_SHIFT) /
+                      tsc_multiplier;
+  } else if (!strcmp(name, "raw")) {
+    clock_source = ClockSource::MONOTONIC_RAW;
+    clock_start = clock_ns(CLOCK_MONOTONIC_RAW) - elapsed;
+  } else if (!strcmp(name, "coarse")) {
+    clock_source = ClockSource::COARSE;
+    clock_start = clock_ns(CLOCK_MONOTONIC_COARSE) - elapsed;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void add_clock_args(EventArgs &args) {
+  static const char *names[] = {"chrono", "tsc", "raw", "coarse"};
+  args.add_string("clock", names[(int)clock_source]);
+  if (clock_source == ClockSource::TSC) {
+    args.add_double("tsc_ticks_per_ns",
+                    double(uint64_t(1) << TSC_SHIFT) / tsc_multiplier);
+    args.add_int("tsc_calibration_ns", tsc_calibration_ns);
+  }
+  TimeStamp chrono_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            clock_t::now() - COMPILATION_START)
+                            .count();
+  args.add_int("clock_drift_ns", ns_from_start() - chrono_ns);
+}
+
+} // namespace externis
@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+namespace externis {
+
+// Parses a duration like "100us", "5ms" or "1s". Plain numbers are in
+// microseconds. Shared by the plugin's arguments and the tools' options.
+inline bool parse_duration(const char *value, int64_t *ns) {
+  if (!value) {
+    return false;
+  }
+  char *end;
+  long long amount = strtoll(value, &end, 10);
+  if (end == value || amount < 0) {
+    return false;
+  }
+  int64_t unit;
+  if (!strcmp(end, "ns")) {
+    unit = 1;
+  } else if (!*end || !strcmp(end, "us")) {
+    unit = 1000;
+  } else if (!strcmp(end, "ms")) {
+    unit = 1000000;
+  } else if (!strcmp(end, "s")) {
+    unit = 1000000000;
+  } else {
+    return false;
+  }
+  *ns = amount * unit;
+  return true;
+}
+
+} // namespace externis
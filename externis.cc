@@ -18,6 +18,7 @@
 #include "externis.h"
 
 #include <cp/cp-tree.h>
+#include <langhooks.h>
 #include <options.h>
 #include <tree-check.h>
 #include <tree-pass.h>
@@ -28,34 +29,112 @@
 
 int plugin_is_GPL_compatible = 1;
 
+// Only the C++ front end has these, and only the C and C++ front ends have
+// parse_in, so they're null in cc1 or lto1.
+extern const char *decl_as_string(tree, int) __attribute__((weak));
+extern tree most_general_template(tree) __attribute__((weak));
+extern cpp_reader *parse_in __attribute__((weak));
+
 namespace externis {
 
-void cb_finish_parse_function(void *gcc_data, void *user_data) {
-  tree decl = (tree)gcc_data;
-  auto expanded_location = expand_location(decl->decl_minimal.locus);
-  auto decl_name = decl_as_string(decl, 0);
-  auto parent_decl = DECL_CONTEXT(decl);
-  const char *scope_name = nullptr;
-  externis::EventCategory scope_type = externis::EventCategory::UNKNOWN;
-  if (parent_decl) {
-    if (TREE_CODE(parent_decl) != TRANSLATION_UNIT_DECL) {
-      scope_name = decl_as_string(parent_decl, 0);
-      switch (TREE_CODE(parent_decl)) {
-      case NAMESPACE_DECL:
-        scope_type = externis::EventCategory::NAMESPACE;
-        break;
-      case RECORD_TYPE:
-      case UNION_TYPE:
-        scope_type = externis::EventCategory::STRUCT;
-        break;
-      default:
-        fprintf(stderr, "Unkown tree code %d\n", TREE_CODE(parent_decl));
-        break;
-      }
+CallbackOverhead callback_overhead[CALLBACK_COUNT];
+
+const char *callback_name(PluginCallback callback) {
+  static const char *strings[CALLBACK_COUNT] = {
+      "cb_start_compilation", "cb_file_change", "cb_finish_decl",
+      "cb_finish_parse_function", "cb_pass_execution", "cb_macro_defined",
+      "cb_macro_used"};
+  return strings[(int)callback];
+}
+
+namespace {
+
+const char *printable_name(tree decl) {
+  if (decl_as_string) {
+    return decl_as_string(decl, 0);
+  }
+  return lang_hooks.decl_printable_name(decl, 2);
+}
+
+} // namespace
+
+const char *function_name(void *function) {
+  return printable_name((tree)function);
+}
+
+const char *function_file_name(void *function) {
+  const char *file =
+      expand_location(DECL_SOURCE_LOCATION((tree)function)).file;
+  return file ? file : "";
+}
+
+void *function_scope(void *function, EventCategory *scope_type) {
+  tree parent_decl = DECL_CONTEXT((tree)function);
+  if (!parent_decl || TREE_CODE(parent_decl) == TRANSLATION_UNIT_DECL) {
+    return nullptr;
+  }
+  switch (TREE_CODE(parent_decl)) {
+  case NAMESPACE_DECL:
+    *scope_type = externis::EventCategory::NAMESPACE;
+    break;
+  case RECORD_TYPE:
+  case UNION_TYPE:
+    *scope_type = externis::EventCategory::STRUCT;
+    break;
+  default:
+    *scope_type = externis::EventCategory::UNKNOWN;
+    fprintf(stderr, "Unkown tree code %d\n", TREE_CODE(parent_decl));
+    break;
+  }
+  return parent_decl;
+}
+
+const char *scope_name(void *scope) { return printable_name((tree)scope); }
+
+void *function_template(void *function, EventCategory *category,
+                        void **specialization) {
+  tree decl = (tree)function;
+  // The lang_decl of other front ends doesn't look like the C++ one.
+  if (!most_general_template || !DECL_LANG_SPECIFIC(decl) ||
+      !DECL_TEMPLATE_INFO(decl) || !DECL_TEMPLATE_INSTANTIATION(decl)) {
+    return nullptr;
+  }
+  tree primary = most_general_template(DECL_TI_TEMPLATE(decl));
+  if (!primary) {
+    return nullptr;
+  }
+  // Members that aren't templates themselves are instantiated from their
+  // class's template.
+  tree context = DECL_CONTEXT(decl);
+  if (!PRIMARY_TEMPLATE_P(primary) && context && CLASS_TYPE_P(context) &&
+      CLASSTYPE_TEMPLATE_INFO(context)) {
+    tree class_primary = most_general_template(CLASSTYPE_TI_TEMPLATE(context));
+    if (class_primary) {
+      *category = EventCategory::INSTANTIATE_MEMBER;
+      *specialization = context;
+      return class_primary;
     }
   }
-  end_parse_function(FinishedFunction{
-      gcc_data, decl_name, expanded_location.file, scope_name, scope_type});
+  *category = EventCategory::INSTANTIATE_FUNCTION;
+  *specialization = decl;
+  return primary;
+}
+
+const char *template_name(void *primary_template) {
+  return printable_name(DECL_TEMPLATE_RESULT((tree)primary_template));
+}
+
+void *pass_function(const opt_pass *pass) {
+  if (pass->type != opt_pass_type::GIMPLE_PASS &&
+      pass->type != opt_pass_type::RTL_PASS) {
+    return nullptr;
+  }
+  return current_function_decl;
+}
+
+void cb_finish_parse_function(void *gcc_data, void *user_data) {
+  ScopedOverhead overhead(CB_FINISH_PARSE_FUNCTION);
+  end_parse_function(FinishedFunction{gcc_data, ns_from_start()});
 }
 
 void cb_plugin_finish(void *gcc_data, void *user_data) { write_all_events(); }
@@ -63,7 +142,9 @@ void cb_plugin_finish(void *gcc_data, void *user_data) { write_all_events(); }
 void (*old_file_change_cb)(cpp_reader *, const line_map_ordinary *);
 void cb_file_change(cpp_reader *pfile, const line_map_ordinary *new_map) {
   if (new_map) {
+    ScopedOverhead overhead(CB_FILE_CHANGE);
     const char *file_name = ORDINARY_MAP_FILE_NAME(new_map);
+    sample_memory();
     if (file_name) {
       switch (new_map->reason) {
       case LC_ENTER:
@@ -80,19 +161,64 @@ void cb_file_change(cpp_reader *pfile, const line_map_ordinary *new_map) {
   (*old_file_change_cb)(pfile, new_map);
 }
 
+// GCC itself uses these for some options (like -dD and -g3), so we chain to
+// whatever was there before.
+void (*old_define_cb)(cpp_reader *, location_t, cpp_hashnode *);
+void cb_macro_defined(cpp_reader *pfile, location_t location,
+                      cpp_hashnode *node) {
+  {
+    ScopedOverhead overhead(CB_MACRO_DEFINED);
+    macro_defined(node, NODE_NAME(node), expand_location(location).file);
+  }
+  if (old_define_cb) {
+    (*old_define_cb)(pfile, location, node);
+  }
+}
+
+// Called for every expansion, including the nested ones.
+void (*old_used_cb)(cpp_reader *, location_t, cpp_hashnode *);
+void cb_macro_used(cpp_reader *pfile, location_t location,
+                   cpp_hashnode *node) {
+  if (cpp_user_macro_p(node)) {
+    ScopedOverhead overhead(CB_MACRO_USED);
+    macro_expanded(node, NODE_NAME(node), node->value.macro->count);
+  }
+  if (old_used_cb) {
+    (*old_used_cb)(pfile, location, node);
+  }
+}
+
 void cb_start_compilation(void *gcc_data, void *user_data) {
+  ScopedOverhead overhead(CB_START_UNIT);
   start_preprocess_file(main_input_filename, nullptr);
+  if (const char *lto_name = lto_process_name()) {
+    set_process_name(lto_name);
+  } else if (main_input_filename) {
+    set_process_name(main_input_filename);
+  }
+  if (!&parse_in || !parse_in) {
+    return; // No preprocessor in lto1.
+  }
   cpp_callbacks *cpp_cbs = cpp_get_callbacks(parse_in);
   old_file_change_cb = cpp_cbs->file_change;
   cpp_cbs->file_change = cb_file_change;
+  if (macro_tracking_enabled()) {
+    old_define_cb = cpp_cbs->define;
+    cpp_cbs->define = cb_macro_defined;
+    old_used_cb = cpp_cbs->used;
+    cpp_cbs->used = cb_macro_used;
+  }
 }
 
 void cb_pass_execution(void *gcc_data, void *user_data) {
+  ScopedOverhead overhead(CB_PASS_EXECUTION);
   auto pass = (opt_pass *)gcc_data;
+  sample_memory();
   start_opt_pass(pass);
 }
 
 void cb_finish_decl(void *gcc_data, void *user_data) {
+  ScopedOverhead overhead(CB_FINISH_DECL);
   finish_preprocessing_stage();
 }
 
@@ -103,44 +229,151 @@ static const char *PLUGIN_NAME = "externis";
 bool setup_output(int argc, plugin_argument *argv) {
   const char *flag_name = "trace";
   const char *dir_flag_name = "trace-dir";
+  const char *socket_flag_name = "socket";
+  const char *complete_events_flag_name = "complete-events";
+  const char *format_flag_name = "format";
+  const char *timevars_flag_name = "timevars";
+  const char *writer_thread_flag_name = "writer-thread";
+  const char *compress_flag_name = "compress";
+  const char *memory_counters_flag_name = "memory-counters";
+  const char *perf_counters_flag_name = "perf-counters";
+  const char *clock_flag_name = "clock";
+  const char *macros_flag_name = "macros";
+  const char *header_db_flag_name = "header-db";
+  const char *max_buffered_flag_name = "max-buffered-events";
   // TODO: Maybe make the default filename related to the source filename.
   // TODO: Validate we only compile one TU at a time.
-  FILE *trace_file = nullptr;
-  if (argc == 0) {
-    char file_template[] = "/tmp/trace_XXXXXX.json";
-    int fd = mkstemps(file_template, 5);
-    if (fd == -1) {
-      perror("Externis mkstemps error: ");
+  const char *file_name = nullptr;
+  const char *dir_name = nullptr;
+  const char *socket_name = nullptr;
+  const char *format_name = nullptr;
+  const char *compression_name = nullptr;
+  bool valid_arguments = true;
+  for (int i = 0; i < argc; ++i) {
+    if (!strcmp(argv[i].key, flag_name) && argv[i].value && !file_name) {
+      file_name = argv[i].value;
+    } else if (!strcmp(argv[i].key, dir_flag_name) && argv[i].value &&
+               !dir_name) {
+      dir_name = argv[i].value;
+    } else if (!strcmp(argv[i].key, socket_flag_name) && argv[i].value &&
+               !socket_name) {
+      socket_name = argv[i].value;
+    } else if (!strcmp(argv[i].key, complete_events_flag_name)) {
+      externis::set_complete_events(true);
+    } else if (!strcmp(argv[i].key, format_flag_name) && argv[i].value &&
+               externis::set_output_format(argv[i].value)) {
+      format_name = argv[i].value;
+    } else if (!strcmp(argv[i].key, timevars_flag_name)) {
+      externis::enable_timevars();
+    } else if (!strcmp(argv[i].key, writer_thread_flag_name)) {
+      externis::set_writer_thread(true);
+    } else if (!strcmp(argv[i].key, memory_counters_flag_name)) {
+      int64_t interval_ns = 0;
+      if (argv[i].value &&
+          !externis::parse_duration(argv[i].value, &interval_ns)) {
+        valid_arguments = false;
+      }
+      externis::enable_memory_counters(interval_ns);
+    } else if (!strcmp(argv[i].key, perf_counters_flag_name)) {
+      externis::enable_perf_counters();
+    } else if (!strcmp(argv[i].key, macros_flag_name)) {
+      externis::enable_macro_tracking();
+    } else if (!strcmp(argv[i].key, header_db_flag_name) && argv[i].value) {
+      externis::set_header_db(argv[i].value);
+    } else if (!strcmp(argv[i].key, max_buffered_flag_name) &&
+               externis::set_max_buffered_events(argv[i].value)) {
+      continue;
+    } else if (!strcmp(argv[i].key, clock_flag_name) && argv[i].value &&
+               externis::set_clock_source(argv[i].value)) {
+      continue;
+    } else if (!strcmp(argv[i].key, compress_flag_name) && argv[i].value &&
+               externis::set_compression(argv[i].value)) {
+      compression_name = argv[i].value;
+    } else if (externis::set_filter_option(argv[i].key, argv[i].value)) {
+      continue;
+    } else {
+      valid_arguments = false;
+    }
+  }
+  if (!valid_arguments || (!!file_name + !!dir_name + !!socket_name > 1)) {
+    fprintf(stderr,
+            "Externis Error! Arguments must be -fplugin-arg-%s-%s=FILENAME, "
+            "-fplugin-arg-%s-%s=DIRECTORY or -fplugin-arg-%s-%s=SOCKET, "
+            "optionally with "
+            "-fplugin-arg-%s-%s=json|perfetto|summary, "
+            "-fplugin-arg-%s-%s=none|gzip|zstd, -fplugin-arg-%s-%s, "
+            "-fplugin-arg-%s-%s, -fplugin-arg-%s-%s, "
+            "-fplugin-arg-%s-%s[=DURATION], -fplugin-arg-%s-%s, "
+            "-fplugin-arg-%s-%s=chrono|tsc|raw|coarse, -fplugin-arg-%s-%s, "
+            "-fplugin-arg-%s-%s=FILENAME, -fplugin-arg-%s-%s=COUNT, "
+            "-fplugin-arg-%s-min-duration[-CATEGORY]=DURATION and "
+            "-fplugin-arg-%s-top-n[-CATEGORY]=COUNT\n",
+            PLUGIN_NAME, flag_name, PLUGIN_NAME, dir_flag_name, PLUGIN_NAME,
+            socket_flag_name, PLUGIN_NAME, format_flag_name, PLUGIN_NAME,
+            compress_flag_name, PLUGIN_NAME, complete_events_flag_name,
+            PLUGIN_NAME, timevars_flag_name, PLUGIN_NAME,
+            writer_thread_flag_name, PLUGIN_NAME, memory_counters_flag_name,
+            PLUGIN_NAME, perf_counters_flag_name, PLUGIN_NAME, clock_flag_name,
+            PLUGIN_NAME, macros_flag_name, PLUGIN_NAME, header_db_flag_name,
+            PLUGIN_NAME, max_buffered_flag_name, PLUGIN_NAME, PLUGIN_NAME);
+    return false;
+  }
+
+  if (socket_name) {
+    // The collector concatenates the packets it's sent into one trace, so
+    // only uncompressed Perfetto traces can be streamed to it.
+    const char *conflict = nullptr;
+    const char *conflict_value = nullptr;
+    if (format_name && strcmp(format_name, "perfetto")) {
+      conflict = format_flag_name;
+      conflict_value = format_name;
+    } else if (compression_name && strcmp(compression_name, "none")) {
+      conflict = compress_flag_name;
+      conflict_value = compression_name;
+    }
+    if (conflict) {
+      fprintf(stderr,
+              "Externis Error! -fplugin-arg-%s-%s only streams uncompressed "
+              "Perfetto traces, it can't be used with -fplugin-arg-%s-%s=%s\n",
+              PLUGIN_NAME, socket_flag_name, PLUGIN_NAME, conflict,
+              conflict_value);
       return false;
     }
-    trace_file = fdopen(fd, "w");
-  } else if (argc == 1 && !strcmp(argv[0].key, flag_name)) {
-    trace_file = fopen(argv[0].value, "w");
+    return externis::set_output_socket(socket_name);
+  }
+
+  FILE *trace_file = nullptr;
+  if (file_name) {
+    externis::set_compression_from_file_name(file_name);
+    trace_file = fopen(file_name, "w");
     if (!trace_file) {
       fprintf(stderr, "Externis Error! Couldn't open %s for writing\n",
-              argv[0].value);
+              file_name);
     }
-  } else if (argc == 1 && !strcmp(argv[0].key, dir_flag_name)) {
-    std::string file_template{argv[0].value};
-    file_template += "/trace_XXXXXX.json";
-    int fd = mkstemps(file_template.data(), 5);
+  } else {
+    const char *extension = externis::output_file_extension();
+    std::string file_template{dir_name ? dir_name : "/tmp"};
+    file_template += "/trace_";
+    // Name the traces of one link's lto1 runs alike.
+    if (externis::lto_stage() != externis::LtoStage::NONE) {
+      file_template += externis::lto_link_name();
+      file_template += '.';
+      file_template += externis::lto_stage_name();
+      if (externis::lto_partition() >= 0) {
+        file_template += std::to_string(externis::lto_partition());
+      }
+      file_template += '_';
+    }
+    file_template += "XXXXXX";
+    file_template += extension;
+    int fd = mkstemps(file_template.data(), strlen(extension));
     if (fd == -1) {
       perror("Externis mkstemps error: ");
       return false;
     }
     trace_file = fdopen(fd, "w");
-  } else {
-    fprintf(stderr,
-            "Externis Error! Arguments must be -fplugin-arg-%s-%s=FILENAME or -fplugin-arg-%s-%s=DIRECTORY\n",
-            PLUGIN_NAME, flag_name, PLUGIN_NAME, dir_flag_name);
-    return false;
-  }
-  if (trace_file) {
-    externis::set_output_file(trace_file);
-    return true;
-  } else {
-    return false;
   }
+  return trace_file && externis::set_output_file(trace_file);
 }
 
 int plugin_init(struct plugin_name_args *plugin_info,
@@ -149,6 +382,7 @@ int plugin_init(struct plugin_name_args *plugin_info,
   static struct plugin_info externis_info = {
       .version = "0.1", .help = "Generate time traces of the compilation."};
   externis::COMPILATION_START = externis::clock_t::now();
+  externis::detect_lto_stage();
   if (!setup_output(plugin_info->argc, plugin_info->argv)) {
     return -1;
   }
@@ -17,15 +17,28 @@
 
 #include <gcc-plugin.h>
 
+#include "duration.h"
+
+#include <algorithm>
+#include <bit>
 #include <chrono>
 #include <cpplib.h>
 #include <cstdio>
-#include <json.h>
-#include <optional>
+#include <ctime>
 #include <pretty-print.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+
+// lto1 has no preprocessor, so the cpplib functions we use might not be
+// linked into it. They're referenced weakly, which lets the plugin load, and
+// are only called from the preprocessor's own callbacks.
+extern cpp_callbacks *cpp_get_callbacks(cpp_reader *) __attribute__((weak));
+extern cpp_buffer *cpp_get_buffer(cpp_reader *) __attribute__((weak));
+extern _cpp_file *cpp_get_file(cpp_buffer *) __attribute__((weak));
+extern cpp_dir *cpp_get_dir(_cpp_file *) __attribute__((weak));
 
 namespace externis {
 
@@ -35,6 +48,14 @@ namespace externis {
 template <class Key, class Value> using map_t = std::unordered_map<Key, Value>;
 template <class Value> using set_t = std::unordered_set<Value>;
 
+// File, function and scope names are interned. Each distinct string is stored
+// once and identified by a small id, which is cheap to hash and compare.
+// interned_string() returns a stable, null terminated copy.
+using StringId = uint32_t;
+constexpr StringId NO_STRING = static_cast<StringId>(-1);
+StringId intern(std::string_view str);
+const char *interned_string(StringId id);
+
 using clock_t = std::chrono::high_resolution_clock;
 using time_point_t = std::chrono::time_point<clock_t>;
 extern time_point_t COMPILATION_START;
@@ -45,10 +66,49 @@ struct TimeSpan {
   int64_t end;
 };
 
+// COMPILATION_START anchors the trace in wall time, but timestamps can come
+// from a cheaper clock, chosen with set_clock_source():
+//   chrono: std::chrono::high_resolution_clock, the default.
+//   tsc: the x86 time stamp counter, calibrated at startup.
+//   raw: CLOCK_MONOTONIC_RAW.
+//   coarse: CLOCK_MONOTONIC_COARSE, only precise to a few milliseconds.
+enum class ClockSource { CHRONO, TSC, MONOTONIC_RAW, COARSE };
+extern ClockSource clock_source;
+// The reading of clock_source at COMPILATION_START, in its own unit.
+extern uint64_t clock_start;
+// Nanoseconds per TSC tick, as a fixed point number with TSC_SHIFT bits.
+constexpr int TSC_SHIFT = 32;
+extern uint64_t tsc_multiplier;
+
+class EventArgs;
+bool set_clock_source(const char *name);
+// The clock's name, calibration and how far it drifted from chrono.
+void add_clock_args(EventArgs &args);
+
+inline TimeStamp clock_ns(clockid_t clock) {
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
 inline TimeStamp ns_from_start() {
-  return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_t::now() -
-                                                              COMPILATION_START)
-      .count();
+  switch (clock_source) {
+#if defined(__x86_64__) || defined(__i386__)
+  case ClockSource::TSC:
+    return (static_cast<unsigned __int128>(__builtin_ia32_rdtsc() -
+                                           clock_start) *
+            tsc_multiplier) >>
+           TSC_SHIFT;
+#endif
+  case ClockSource::MONOTONIC_RAW:
+    return clock_ns(CLOCK_MONOTONIC_RAW) - clock_start;
+  case ClockSource::COARSE:
+    return clock_ns(CLOCK_MONOTONIC_COARSE) - clock_start;
+  default:
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               clock_t::now() - COMPILATION_START)
+        .count();
+  }
 }
 
 enum EventCategory {
@@ -62,39 +122,286 @@ enum EventCategory {
   RTL_PASS,
   SIMPLE_IPA_PASS,
   IPA_PASS,
+  // All the passes executed on one function
+  OPTIMIZE,
+  // Totals of GCC's own timevars
+  TIMEVAR,
+  // The plugin's own overhead
+  EXTERNIS,
+  // Headers ranked by the time spent in them, excluding their includes
+  HEADER,
+  // Macros ranked by the tokens their expansions produced
+  MACRO,
+  // Instantiated functions. Member functions of class templates, which GCC
+  // instantiates once they're used, are INSTANTIATE_MEMBER, the rest
+  // (function templates and member function templates) are
+  // INSTANTIATE_FUNCTION. Class instantiations themselves aren't events.
+  INSTANTIATE_FUNCTION,
+  INSTANTIATE_MEMBER,
+  // Primary templates ranked by the time spent instantiating them
+  TEMPLATE,
   //
   UNKNOWN
 };
+constexpr int CATEGORY_COUNT = UNKNOWN + 1;
+
+// Thread ids of the tracks we write events to.
+enum TrackId {
+  MAIN_TID = 0,
+  EXTERNIS_TID = 1,
+  TIMEVAR_PHASES_TID = 2,
+  TIMEVARS_TID = 3,
+  HEADERS_TID = 4,
+  MACROS_TID = 5,
+  TEMPLATES_TID = 6,
+};
+
+// Event arguments are typed and stored inline, so creating, copying and
+// queueing events never allocates. Keys and string values must outlive the
+// event - they're either literals or interned strings.
+struct EventArg {
+  enum Type { INT, DOUBLE, STRING };
+  const char *key;
+  Type type;
+  union {
+    int64_t int_value;
+    double double_value;
+    const char *string_value;
+  };
+};
+
+constexpr int MAX_EVENT_ARGS = 8;
+class EventArgs {
+public:
+  void add_int(const char *key, int64_t value) {
+    if (EventArg *arg = add(key, EventArg::INT)) {
+      arg->int_value = value;
+    }
+  }
+  void add_double(const char *key, double value) {
+    if (EventArg *arg = add(key, EventArg::DOUBLE)) {
+      arg->double_value = value;
+    }
+  }
+  void add_string(const char *key, const char *value) {
+    if (EventArg *arg = add(key, EventArg::STRING)) {
+      arg->string_value = value;
+    }
+  }
+
+  const EventArg *begin() const { return values; }
+  const EventArg *end() const { return values + count; }
+
+private:
+  EventArg *add(const char *key, EventArg::Type type) {
+    if (count == MAX_EVENT_ARGS) {
+      return nullptr;
+    }
+    EventArg *arg = &values[count++];
+    arg->key = key;
+    arg->type = type;
+    return arg;
+  }
+
+  int count = 0;
+  EventArg values[MAX_EVENT_ARGS];
+};
 
 struct TraceEvent {
   const char *name;
   EventCategory category;
   TimeSpan ts;
-  std::optional<map_t<std::string, std::string>> args;
+  EventArgs args = {};
+  int tid = MAIN_TID;
+  // Written as an instant event at ts.start, for things that aren't timed.
+  bool instant = false;
+};
+
+// We keep track of the time spent inside our own callbacks, so the overhead of
+// the plugin can be written to the trace as well.
+enum PluginCallback {
+  CB_START_UNIT,
+  CB_FILE_CHANGE,
+  CB_FINISH_DECL,
+  CB_FINISH_PARSE_FUNCTION,
+  CB_PASS_EXECUTION,
+  CB_MACRO_DEFINED,
+  CB_MACRO_USED,
+  CALLBACK_COUNT
+};
+struct CallbackOverhead {
+  int64_t calls;
+  TimeStamp total_ns;
 };
+extern CallbackOverhead callback_overhead[CALLBACK_COUNT];
+const char *callback_name(PluginCallback callback);
+
+class ScopedOverhead {
+public:
+  explicit ScopedOverhead(PluginCallback callback)
+      : callback(callback), start(ns_from_start()) {}
+  ~ScopedOverhead() {
+    callback_overhead[callback].calls++;
+    callback_overhead[callback].total_ns += ns_from_start() - start;
+  }
+
+private:
+  PluginCallback callback;
+  TimeStamp start;
+};
+
+// In summary mode (the "summary" output format) no events are kept. Passes,
+// headers and the scopes of functions are only aggregated into these, so
+// memory use doesn't grow with the number of events.
+constexpr int HISTOGRAM_BUCKETS = 40;
+struct Aggregate {
+  int64_t count = 0;
+  TimeStamp total_ns = 0;
+  TimeStamp max_ns = 0;
+  // Bucket i counts durations in [2^i, 2^(i+1)) nanoseconds.
+  int64_t histogram[HISTOGRAM_BUCKETS] = {};
+
+  void add(TimeStamp ns) {
+    ++count;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+    int bucket = ns > 0 ? std::bit_width(static_cast<uint64_t>(ns)) - 1 : 0;
+    ++histogram[std::min(bucket, HISTOGRAM_BUCKETS - 1)];
+  }
+};
+struct SummaryRow {
+  const char *name;
+  const Aggregate *aggregate;
+};
+bool summary_mode();
+void write_summary_tables();
+void write_summary_table(const char *table,
+                         const std::vector<SummaryRow> &rows);
 
 void start_preprocess_file(const char *file_name, cpp_reader *pfile);
 void end_preprocess_file();
 void finish_preprocessing_stage();
 void write_preprocessing_events();
+void add_preprocessing_stats(EventArgs &args);
+// How often full buffers were flushed before the end of the compilation.
+void add_buffering_stats(EventArgs &args);
+
+// The header database collects the preprocessing cost of every header over
+// all the TUs of a build, so it's shared by all compilations and only ever
+// appended to.
+struct HeaderCost {
+  const char *name;
+  TimeStamp self_ns;
+  TimeStamp inclusive_ns;
+  int64_t inclusions;
+};
+void set_header_db(const char *path);
+bool header_db_enabled();
+void append_to_header_db(const char *tu, const std::vector<HeaderCost> &costs);
+// Appends this TU's header costs, if the header database is enabled.
+void write_header_db();
 
 void start_opt_pass(const opt_pass *pass);
-void write_opt_pass_events();
+void *pass_function(const opt_pass *pass);
+
+void enable_timevars();
+void write_timevar_events();
+
+// Macros are identified by their cpplib hash node, which lives as long as the
+// compilation, so their names don't have to be copied.
+void enable_macro_tracking();
+bool macro_tracking_enabled();
+void macro_defined(const void *macro, const char *name, const char *file);
+// tokens is the length of the macro's replacement list.
+void macro_expanded(const void *macro, const char *name, int64_t tokens);
+void write_macro_events();
+
+// Under -flto, the link runs lto1 once for WPA and once per LTRANS partition.
+// All of them are named after the link, so their traces can be put together.
+enum class LtoStage { NONE, LTO, WPA, LTRANS };
+// Needs GCC's options, so it's called from plugin_init.
+void detect_lto_stage();
+LtoStage lto_stage();
+const char *lto_stage_name();
+// Unique to the link, but a temporary file name.
+const char *lto_link_name();
+// The -o of the link, or "" if we couldn't find it.
+const char *lto_link_output();
+// -1 outside of LTRANS.
+int lto_partition();
+// nullptr when not in lto1.
+const char *lto_process_name();
+
+// Samples the GGC allocations and the RSS as counters, at most once every
+// interval_ns.
+void enable_memory_counters(TimeStamp interval_ns);
+void sample_memory();
 
-void set_output_file(FILE *file);
+// Hardware counters from perf_event_open, read at pass and function
+// boundaries. Events get the difference between their start and end.
+constexpr int PERF_COUNTER_COUNT = 4;
+struct PerfCounts {
+  uint64_t values[PERF_COUNTER_COUNT] = {};
+};
+// Returns false if the counters aren't available, e.g. in some VMs or with a
+// restrictive perf_event_paranoid.
+bool enable_perf_counters();
+bool perf_counters_enabled();
+PerfCounts read_perf_counters();
+void add_perf_counter_args(EventArgs &args, const PerfCounts &delta);
+
+bool set_output_format(const char *format);
+// Compression is one of none, gzip or zstd. Without an explicit choice it is
+// picked from the trace file's suffix (.gz or .zst).
+bool set_compression(const char *compression);
+void set_compression_from_file_name(const char *file_name);
+// Includes the compression suffix.
+const char *output_file_extension();
+// Takes ownership of the file. Returns false if it can't be written to.
+bool set_output_file(FILE *file);
+// Streams the trace to externis-collect over a Unix domain socket instead,
+// always in the Perfetto format.
+bool set_output_socket(const char *path);
+void set_complete_events(bool enabled);
+bool set_filter_option(const char *key, const char *value);
+void set_track_name(int tid, const char *name);
+// Names the compiler's process after the TU, so merged traces of many TUs can
+// tell them apart.
+void set_process_name(const char *name);
+void set_writer_thread(bool enabled);
+// Finished events are buffered until the end of the compilation, but at most
+// this many of each kind. Full buffers are written to the trace early, or
+// spilled to a temporary file. Zero means no limit.
+bool set_max_buffered_events(const char *value);
+size_t max_buffered_events();
+bool events_are_streamed();
+bool should_keep_event(EventCategory category, TimeSpan ts);
 void add_event(const TraceEvent &event);
+// Counters aren't filtered and are written right away. Every integer argument
+// of the event is the value of a counter at the start of the event.
+void write_counters(const TraceEvent &event);
 void write_all_events();
 void write_event(const TraceEvent &, bool);
 
+// Pretty printing names is expensive, so we only remember the function's tree
+// and ask for its name once we know the event is going to be written.
 struct FinishedFunction {
   void *decl;
-  const char *name;
-  const char *file_name;
-  const char *scope_name;
-  EventCategory scope_type;
+  TimeStamp ts;
 };
+const char *function_name(void *function);
+const char *function_file_name(void *function);
+void *function_scope(void *function, EventCategory *scope_type);
+const char *scope_name(void *scope);
+// The primary template a function was instantiated from, or nullptr if it
+// isn't an instantiation. For members of class templates this is the class
+// template, and specialization is set to their class.
+void *function_template(void *function, EventCategory *category,
+                        void **specialization);
+const char *template_name(void *primary_template);
 void end_parse_function(FinishedFunction);
-void write_all_scopes();
-void write_all_functions();
+
+// Writes the pass, function and scope events that are still buffered.
+void write_finished_events();
 
 } // namespace externis
\ No newline at end of file
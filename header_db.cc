@@ -0,0 +1,109 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "externis.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace externis {
+
+namespace {
+
+const char *header_db_path = nullptr;
+
+// Every TU appends a block of lines, which externis-headers reads:
+//   T <beginningOfTime in us> <TU>
+//   H <self ns> <inclusive ns> <inclusions> <header>
+// Names come last, so they can contain spaces.
+std::string format_records(const char *tu,
+                           const std::vector<HeaderCost> &costs) {
+  std::string records;
+  char line[128];
+  snprintf(line, sizeof(line), "T %" PRId64 " ",
+           std::chrono::duration_cast<std::chrono::microseconds>(
+               COMPILATION_START.time_since_epoch())
+               .count());
+  records += line;
+  records += tu;
+  records += '\n';
+  for (const HeaderCost &cost : costs) {
+    if (strchr(cost.name, '\n')) {
+      continue;
+    }
+    snprintf(line, sizeof(line), "H %" PRId64 " %" PRId64 " %" PRId64 " ",
+             cost.self_ns, cost.inclusive_ns, cost.inclusions);
+    records += line;
+    records += cost.name;
+    records += '\n';
+  }
+  return records;
+}
+
+bool write_all(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(fd, data.data() + written, data.size() - written);
+    if (result < 0 && errno != EINTR) {
+      return false;
+    }
+    written += std::max<ssize_t>(result, 0);
+  }
+  return true;
+}
+
+} // namespace
+
+void set_header_db(const char *path) { header_db_path = path; }
+
+bool header_db_enabled() { return header_db_path; }
+
+// Many compilations append to the database at the same time, so each TU's
+// block is written under an exclusive lock. That keeps blocks from being
+// interleaved even where O_APPEND alone doesn't, like on NFS.
+void append_to_header_db(const char *tu, const std::vector<HeaderCost> &costs) {
+  std::string records = format_records(tu, costs);
+  int fd = open(header_db_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                0666);
+  if (fd == -1) {
+    fprintf(stderr, "Externis Error! Couldn't open the header database %s\n",
+            header_db_path);
+    return;
+  }
+  struct flock lock = {};
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  int result;
+  while ((result = fcntl(fd, F_SETLKW, &lock)) == -1 && errno == EINTR) {
+  }
+  if (result == -1) {
+    fprintf(stderr, "Externis Error! Couldn't lock the header database %s\n",
+            header_db_path);
+  } else if (!write_all(fd, records)) {
+    fprintf(stderr,
+            "Externis Error! Couldn't write to the header database %s\n",
+            header_db_path);
+  }
+  // Closing the file releases the lock.
+  close(fd);
+}
+
+} // namespace externis
@@ -0,0 +1,322 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "output.h"
+
+#include <cinttypes>
+#include <cstring>
+
+namespace externis {
+
+namespace {
+
+// The pieces of JSON both of our JSON formats are made of.
+class JsonOutput {
+protected:
+  explicit JsonOutput(OutputBuffer &output) : output(output) {}
+
+  // Writes the arguments as members of an object, each preceded by a comma.
+  void write_args(const EventArgs &args) {
+    for (const EventArg &arg : args) {
+      output.write(',');
+      write_string(arg.key);
+      output.write(':');
+      switch (arg.type) {
+      case EventArg::INT:
+        write_int(arg.int_value);
+        break;
+      case EventArg::DOUBLE:
+        write_double(arg.double_value);
+        break;
+      case EventArg::STRING:
+        write_string(arg.string_value);
+        break;
+      }
+    }
+  }
+
+  void write_double(double value) {
+    char digits[32];
+    int length = snprintf(digits, sizeof(digits), "%.9g", value);
+    output.write(digits, length);
+  }
+
+  void write_int(int64_t value) {
+    char digits[24];
+    int length = snprintf(digits, sizeof(digits), "%" PRId64, value);
+    output.write(digits, length);
+  }
+
+  // Timestamps are in nanoseconds, JSON format is in microseconds.
+  void write_timestamp(TimeStamp ts) {
+    char digits[32];
+    const char *sign = ts < 0 ? "-" : "";
+    uint64_t abs_ts = ts < 0 ? -static_cast<uint64_t>(ts) : ts;
+    int length = snprintf(digits, sizeof(digits), "%s%" PRIu64 ".%03" PRIu64,
+                          sign, abs_ts / 1000, abs_ts % 1000);
+    output.write(digits, length);
+  }
+
+  void write_string(const char *str) {
+    output.write('"');
+    const char *run_start = str;
+    for (const char *c = str; *c; ++c) {
+      const char *escaped = nullptr;
+      char control[8];
+      switch (*c) {
+      case '"':
+        escaped = "\\\"";
+        break;
+      case '\\':
+        escaped = "\\\\";
+        break;
+      case '\n':
+        escaped = "\\n";
+        break;
+      case '\t':
+        escaped = "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(*c) < 0x20) {
+          snprintf(control, sizeof(control), "\\u%04x", *c);
+          escaped = control;
+        }
+        break;
+      }
+      if (escaped) {
+        output.write(run_start, c - run_start);
+        output.write(escaped);
+        run_start = c + 1;
+      }
+    }
+    output.write(run_start, strlen(run_start));
+    output.write('"');
+  }
+
+  // Top level members that tell externis-merge which link, stage and
+  // partition an lto1 trace belongs to.
+  void write_lto_fields() {
+    if (lto_stage() == LtoStage::NONE) {
+      return;
+    }
+    output.write(",\"ltoLink\":");
+    write_string(lto_link_name());
+    if (*lto_link_output()) {
+      output.write(",\"ltoOutput\":");
+      write_string(lto_link_output());
+    }
+    output.write(",\"ltoStage\":");
+    write_string(lto_stage_name());
+    if (lto_partition() >= 0) {
+      output.write(",\"ltoPartition\":");
+      write_int(lto_partition());
+    }
+  }
+
+  OutputBuffer &output;
+};
+
+class JsonWriter : public TraceWriter, JsonOutput {
+public:
+  JsonWriter(OutputBuffer &output, bool complete_events)
+      : JsonOutput(output), complete_events(complete_events) {}
+
+  void write_header() override {
+    output.write("{\"displayTimeUnit\":\"ns\",\"beginningOfTime\":");
+    write_int(std::chrono::duration_cast<std::chrono::microseconds>(
+                  COMPILATION_START.time_since_epoch())
+                  .count());
+    write_lto_fields();
+    output.write(",\"traceEvents\":[");
+  }
+
+  void write_event(const TraceEvent &event, int pid, int tid,
+                   int uid) override {
+    if (event.instant) {
+      new_event(event, pid, tid, event.ts.start, "i", uid);
+    } else if (complete_events) {
+      new_event(event, pid, tid, event.ts.start, "X", uid);
+    } else {
+      new_event(event, pid, tid, event.ts.start, "B", uid);
+      new_event(event, pid, tid, event.ts.end, "E", uid);
+    }
+  }
+
+  void write_thread_name(int pid, int tid, const char *name) override {
+    output.write(first_event ? "{" : ",{");
+    first_event = false;
+    output.write("\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+    write_int(pid);
+    output.write(",\"tid\":");
+    write_int(tid);
+    output.write(",\"args\":{\"name\":");
+    write_string(name);
+    output.write("}}");
+  }
+
+  void write_counters(const TraceEvent &event, int pid) override {
+    output.write(first_event ? "{" : ",{");
+    first_event = false;
+    output.write("\"name\":");
+    write_string(event.name);
+    output.write(",\"ph\":\"C\",\"ts\":");
+    write_timestamp(event.ts.start);
+    output.write(",\"pid\":");
+    write_int(pid);
+    output.write(",\"tid\":");
+    write_int(event.tid);
+    output.write(",\"args\":{");
+    bool first_arg = true;
+    for (const EventArg &arg : event.args) {
+      if (arg.type != EventArg::INT) {
+        continue;
+      }
+      if (!first_arg) {
+        output.write(',');
+      }
+      first_arg = false;
+      write_string(arg.key);
+      output.write(':');
+      write_int(arg.int_value);
+    }
+    output.write("}}");
+  }
+
+  void write_process_name(int pid, const char *name) override {
+    output.write(first_event ? "{" : ",{");
+    first_event = false;
+    output.write("\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+    write_int(pid);
+    output.write(",\"args\":{\"name\":");
+    write_string(name);
+    output.write("}}");
+  }
+
+  void write_footer() override { output.write("]}"); }
+
+private:
+  void new_event(const TraceEvent &event, int pid, int tid, TimeStamp ts,
+                 const char *phase, int this_uid) {
+    output.write(first_event ? "{" : ",{");
+    first_event = false;
+    output.write("\"name\":");
+    write_string(event.name);
+    output.write(",\"ph\":");
+    write_string(phase);
+    output.write(",\"cat\":");
+    write_string(category_string(event.category));
+    output.write(",\"ts\":");
+    write_timestamp(ts);
+    if (!strcmp(phase, "X")) {
+      output.write(",\"dur\":");
+      write_timestamp(event.ts.end - event.ts.start);
+    }
+    output.write(",\"pid\":");
+    write_int(pid);
+    output.write(",\"tid\":");
+    write_int(tid);
+    output.write(",\"args\":{\"UID\":");
+    write_int(this_uid);
+    write_args(event.args);
+    output.write("}}");
+  }
+
+  // Write a single "X" event with a duration instead of a "B" and "E" pair.
+  bool complete_events;
+  bool first_event = true;
+};
+
+// A single JSON object with the totals of the TU and of our own overhead, and
+// the summary tables. Histogram bucket i counts the durations in
+// [2^i, 2^(i+1)) nanoseconds; trailing empty buckets are left out.
+class JsonSummaryWriter : public TraceWriter, JsonOutput {
+public:
+  explicit JsonSummaryWriter(OutputBuffer &output) : JsonOutput(output) {}
+
+  void write_header() override {
+    output.write("{\"beginningOfTime\":");
+    write_int(std::chrono::duration_cast<std::chrono::microseconds>(
+                  COMPILATION_START.time_since_epoch())
+                  .count());
+    write_lto_fields();
+  }
+
+  void write_event(const TraceEvent &event, int pid, int tid,
+                   int uid) override {
+    if (event.category != EventCategory::TU &&
+        event.category != EventCategory::EXTERNIS) {
+      return;
+    }
+    output.write(',');
+    write_string(event.name);
+    output.write(":{\"duration_ns\":");
+    write_int(event.ts.end - event.ts.start);
+    write_args(event.args);
+    output.write('}');
+  }
+
+  void write_thread_name(int pid, int tid, const char *name) override {}
+  void write_process_name(int pid, const char *name) override {}
+  void write_counters(const TraceEvent &event, int pid) override {}
+
+  void write_summary_table(const char *table,
+                           const std::vector<SummaryRow> &rows) override {
+    output.write(',');
+    write_string(table);
+    output.write(":[");
+    for (size_t i = 0; i < rows.size(); ++i) {
+      const Aggregate &aggregate = *rows[i].aggregate;
+      output.write(i ? ",{\"name\":" : "{\"name\":");
+      write_string(rows[i].name);
+      output.write(",\"count\":");
+      write_int(aggregate.count);
+      output.write(",\"total_ns\":");
+      write_int(aggregate.total_ns);
+      output.write(",\"max_ns\":");
+      write_int(aggregate.max_ns);
+      output.write(",\"histogram\":[");
+      int buckets = HISTOGRAM_BUCKETS;
+      while (buckets > 0 && !aggregate.histogram[buckets - 1]) {
+        --buckets;
+      }
+      for (int bucket = 0; bucket < buckets; ++bucket) {
+        if (bucket) {
+          output.write(',');
+        }
+        write_int(aggregate.histogram[bucket]);
+      }
+      output.write("]}");
+    }
+    output.write(']');
+  }
+
+  void write_footer() override { output.write('}'); }
+};
+
+} // namespace
+
+std::unique_ptr<TraceWriter> make_json_writer(OutputBuffer &output,
+                                              bool complete_events) {
+  return std::make_unique<JsonWriter>(output, complete_events);
+}
+
+std::unique_ptr<TraceWriter> make_json_summary_writer(OutputBuffer &output) {
+  return std::make_unique<JsonSummaryWriter>(output);
+}
+
+} // namespace externis
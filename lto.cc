@@ -0,0 +1,139 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <gcc-plugin.h>
+
+#include "externis.h"
+
+#include <langhooks.h>
+#include <options.h>
+
+namespace externis {
+
+namespace {
+
+LtoStage stage = LtoStage::NONE;
+std::string link_name;
+std::string link_output;
+int partition = -1;
+std::string process_name;
+
+// WPA writes its partitions next to its -fltrans-output-list file, so the
+// list (tmp.ltrans.out) and every partition (tmp.ltrans0.o, or
+// tmp.ltrans0.ltrans.o for the LTRANS output) start with the same name.
+void parse_ltrans_file_name(const char *file_name, bool with_partition) {
+  std::string_view name = file_name ? file_name : "";
+  size_t slash = name.rfind('/');
+  if (slash != std::string_view::npos) {
+    name.remove_prefix(slash + 1);
+  }
+  size_t ltrans = name.find(".ltrans");
+  if (ltrans == std::string_view::npos) {
+    link_name = name.empty() ? "lto" : name;
+    return;
+  }
+  link_name = name.substr(0, ltrans);
+  if (with_partition) {
+    const char *digits = name.data() + ltrans + strlen(".ltrans");
+    if (*digits >= '0' && *digits <= '9') {
+      partition = atoi(digits);
+    }
+  }
+}
+
+// lto1 inherits the link's options from the driver, through lto-wrapper, as
+// '-o' 'a.out' '-flto' ...
+void find_link_output() {
+  const char *options = getenv("COLLECT_GCC_OPTIONS");
+  const char *output = options ? strstr(options, "'-o' '") : nullptr;
+  if (!output) {
+    return;
+  }
+  output += strlen("'-o' '");
+  const char *end = strchr(output, '\'');
+  if (end) {
+    link_output.assign(output, end);
+  }
+}
+
+} // namespace
+
+void detect_lto_stage() {
+  if (flag_wpa) {
+    stage = LtoStage::WPA;
+    parse_ltrans_file_name(ltrans_output_list, false);
+  } else if (flag_ltrans) {
+    stage = LtoStage::LTRANS;
+    parse_ltrans_file_name(asm_file_name, true);
+  } else if (!strcmp(lang_hooks.name, "GNU GIMPLE")) {
+    // lto1 without partitioning, like with -flto-partition=none.
+    stage = LtoStage::LTO;
+    parse_ltrans_file_name(asm_file_name, false);
+  }
+  if (stage != LtoStage::NONE) {
+    find_link_output();
+  }
+}
+
+LtoStage lto_stage() { return stage; }
+
+const char *lto_stage_name() {
+  switch (stage) {
+  case LtoStage::NONE:
+    return "";
+  case LtoStage::LTO:
+    return "lto";
+  case LtoStage::WPA:
+    return "wpa";
+  case LtoStage::LTRANS:
+    return "ltrans";
+  }
+  return "";
+}
+
+const char *lto_link_name() { return link_name.c_str(); }
+
+const char *lto_link_output() { return link_output.c_str(); }
+
+int lto_partition() { return partition; }
+
+const char *lto_process_name() {
+  if (stage == LtoStage::NONE) {
+    return nullptr;
+  }
+  if (process_name.empty()) {
+    process_name = link_output.empty() ? link_name : link_output;
+    switch (stage) {
+    case LtoStage::NONE:
+      break;
+    case LtoStage::LTO:
+      process_name += " LTO";
+      break;
+    case LtoStage::WPA:
+      process_name += " WPA";
+      break;
+    case LtoStage::LTRANS:
+      process_name += " LTRANS ";
+      process_name += std::to_string(partition);
+      break;
+    }
+  }
+  return process_name.c_str();
+}
+
+} // namespace externis
@@ -0,0 +1,112 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "externis.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace externis {
+
+namespace {
+
+bool macros_enabled = false;
+
+struct MacroStats {
+  const char *name;
+  // When the macro was first defined or expanded.
+  TimeStamp first_seen = 0;
+  StringId file = NO_STRING;
+  int64_t definitions = 0;
+  int64_t expansions = 0;
+  int64_t tokens = 0;
+};
+map_t<const void *, MacroStats> macro_stats;
+
+MacroStats &stats_for(const void *macro, const char *name) {
+  auto [it, inserted] = macro_stats.try_emplace(macro);
+  if (inserted) {
+    it->second.name = name;
+    it->second.first_seen = ns_from_start();
+  }
+  return it->second;
+}
+
+// Only the heaviest macros are written.
+constexpr size_t MACRO_SUMMARY_SIZE = 50;
+
+} // namespace
+
+void enable_macro_tracking() { macros_enabled = true; }
+
+bool macro_tracking_enabled() { return macros_enabled; }
+
+void macro_defined(const void *macro, const char *name, const char *file) {
+  MacroStats &stats = stats_for(macro, name);
+  if (!stats.definitions++ && file) {
+    stats.file = intern(file);
+  }
+}
+
+void macro_expanded(const void *macro, const char *name, int64_t tokens) {
+  MacroStats &stats = stats_for(macro, name);
+  ++stats.expansions;
+  stats.tokens += tokens;
+}
+
+// cpplib doesn't tell us when an expansion ends, so there's nothing to time.
+// Instead, the macros that produced the most tokens are written as instant
+// events on their own track, at the time they were first seen.
+void write_macro_events() {
+  if (!macros_enabled) {
+    return;
+  }
+  std::vector<const MacroStats *> macros;
+  macros.reserve(macro_stats.size());
+  for (const auto &[macro, stats] : macro_stats) {
+    if (stats.tokens) {
+      macros.push_back(&stats);
+    }
+  }
+  size_t count = std::min(MACRO_SUMMARY_SIZE, macros.size());
+  std::partial_sort(macros.begin(), macros.begin() + count, macros.end(),
+                    [](const MacroStats *lhs, const MacroStats *rhs) {
+                      return lhs->tokens > rhs->tokens;
+                    });
+
+  set_track_name(MACROS_TID, "macros by tokens produced");
+  for (size_t i = 0; i < count; ++i) {
+    const MacroStats &stats = *macros[i];
+    TraceEvent event{stats.name,
+                     EventCategory::MACRO,
+                     {stats.first_seen, stats.first_seen},
+                     {},
+                     MACROS_TID};
+    event.instant = true;
+    event.args.add_int("rank", i + 1);
+    event.args.add_int("expansions", stats.expansions);
+    event.args.add_int("tokens", stats.tokens);
+    event.args.add_int("definitions", stats.definitions);
+    if (stats.file != NO_STRING) {
+      event.args.add_string("file", interned_string(stats.file));
+    }
+    add_event(event);
+  }
+}
+
+} // namespace externis
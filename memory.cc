@@ -0,0 +1,89 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <gcc-plugin.h>
+
+#include "externis.h"
+
+#include <fcntl.h>
+#include <timevar.h>
+#include <unistd.h>
+
+namespace externis {
+
+namespace {
+
+bool memory_counters_enabled = false;
+TimeStamp sample_interval_ns = 0;
+TimeStamp last_sample_ts = 0;
+bool sampled = false;
+// Kept open so that a sample costs a single pread().
+int statm_fd = -1;
+int64_t page_size = 0;
+
+int64_t read_rss_bytes() {
+  char statm[128];
+  ssize_t length = pread(statm_fd, statm, sizeof(statm) - 1, 0);
+  if (length <= 0) {
+    return 0;
+  }
+  statm[length] = '\0';
+  // The fields are the total program size and the resident set size, in
+  // pages.
+  long long pages = 0;
+  if (sscanf(statm, "%*s %lld", &pages) != 1) {
+    return 0;
+  }
+  return pages * page_size;
+}
+
+} // namespace
+
+void enable_memory_counters(TimeStamp interval_ns) {
+  memory_counters_enabled = true;
+  sample_interval_ns = interval_ns;
+  statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  if (statm_fd == -1) {
+    perror("Externis warning: Couldn't open /proc/self/statm, RSS won't be "
+           "sampled: ");
+  }
+  page_size = sysconf(_SC_PAGESIZE);
+}
+
+void sample_memory() {
+  if (!memory_counters_enabled || summary_mode()) {
+    return;
+  }
+  TimeStamp now = ns_from_start();
+  if (sampled && now - last_sample_ts < sample_interval_ns) {
+    return;
+  }
+  sampled = true;
+  last_sample_ts = now;
+
+  TraceEvent event{"memory", EventCategory::UNKNOWN, {now, now}};
+  // GGC doesn't expose the size of its heap, but it counts everything it
+  // allocates for -ftime-report.
+  event.args.add_int("ggc_allocated_bytes", timevar_ggc_mem_total);
+  if (statm_fd != -1) {
+    event.args.add_int("rss_bytes", read_rss_bytes());
+  }
+  write_counters(event);
+}
+
+} // namespace externis
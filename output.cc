@@ -16,96 +16,487 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include "externis.h"
-#include <plugin-version.h>
+#include "output.h"
+#include "ring_buffer.h"
+#include "trace_files.h"
+#include <algorithm>
+#include <array>
 #include <sys/types.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 
 namespace externis {
 
-constexpr int MINIMUM_EVENT_LENGTH_NS = 1000000; // 1ms
+constexpr int64_t DEFAULT_MINIMUM_EVENT_LENGTH_NS = 1000000; // 1ms
+constexpr int64_t DEFAULT_MAX_BUFFERED_EVENTS = 1 << 16;
 
 namespace {
 
-json::object *output_json;
-json::array *output_events_list;
-static std::FILE *trace_file;
+OutputBuffer output;
+std::unique_ptr<TraceWriter> writer;
+OutputFormat output_format = OutputFormat::JSON;
+bool complete_events = false;
+Compression compression = Compression::NONE;
+bool compression_set = false;
+
+// With a writer thread, the compilation thread only queues events and the
+// writer thread serializes them and writes the trace file.
+struct WriterCommand {
+  enum Kind { EVENT, THREAD_NAME, PROCESS_NAME, COUNTERS, STOP };
+  Kind kind;
+  TraceEvent event;
+  int pid;
+  int uid;
+};
+constexpr size_t WRITER_QUEUE_SIZE = 4096;
+using WriterQueue = SpscRingBuffer<WriterCommand, WRITER_QUEUE_SIZE>;
+bool use_writer_thread = false;
+int64_t buffered_events_limit = DEFAULT_MAX_BUFFERED_EVENTS;
+// These are deliberately leaked if GCC exits without PLUGIN_FINISH (e.g. on a
+// fatal error), because destroying a running std::thread terminates.
+WriterQueue *writer_queue = nullptr;
+std::thread *writer_thread = nullptr;
+
+void run_writer_thread() {
+  WriterCommand command;
+  while (true) {
+    if (!writer_queue->try_pop(command)) {
+      writer_queue->wait_for_push();
+      continue;
+    }
+    switch (command.kind) {
+    case WriterCommand::EVENT:
+      writer->write_event(command.event, command.pid, command.event.tid,
+                          command.uid);
+      break;
+    case WriterCommand::THREAD_NAME:
+      writer->write_thread_name(command.pid, command.event.tid,
+                                command.event.name);
+      break;
+    case WriterCommand::PROCESS_NAME:
+      writer->write_process_name(command.pid, command.event.name);
+      break;
+    case WriterCommand::COUNTERS:
+      writer->write_counters(command.event, command.pid);
+      break;
+    case WriterCommand::STOP:
+      return;
+    }
+  }
+}
+
+void queue_command(WriterCommand &&command) {
+  while (!writer_queue->try_push(std::move(command))) {
+    // The writer thread is behind, give it a chance to catch up.
+    std::this_thread::yield();
+  }
+}
+
+// Filtering configuration, per category. A negative value means the category
+// uses the value given for all categories.
+int64_t default_minimum_length_ns = DEFAULT_MINIMUM_EVENT_LENGTH_NS;
+std::array<int64_t, CATEGORY_COUNT> unset_per_category() {
+  std::array<int64_t, CATEGORY_COUNT> values;
+  values.fill(-1);
+  return values;
+}
+std::array<int64_t, CATEGORY_COUNT> default_minimum_lengths() {
+  auto values = unset_per_category();
+  // Macro events are measured in tokens, not time.
+  values[EventCategory::MACRO] = 0;
+  return values;
+}
+std::array<int64_t, CATEGORY_COUNT> minimum_length_ns =
+    default_minimum_lengths();
+// Zero means every event that passes the length filter is written.
+int64_t default_top_n = 0;
+std::array<int64_t, CATEGORY_COUNT> top_n = unset_per_category();
+
+// In top-N mode we keep the longest events of each category in a min-heap,
+// and only write them at the end of the compilation.
+struct RetainedEvents {
+  std::vector<TraceEvent> heap;
+  size_t limit = 0;
+};
+std::array<RetainedEvents, CATEGORY_COUNT> retained_events;
+
+TimeStamp duration(const TraceEvent &event) {
+  return event.ts.end - event.ts.start;
+}
+
+bool longer(const TraceEvent &lhs, const TraceEvent &rhs) {
+  return duration(lhs) > duration(rhs);
+}
+
+int64_t minimum_length(EventCategory category) {
+  int64_t value = minimum_length_ns[category];
+  return value < 0 ? default_minimum_length_ns : value;
+}
+
+// Names of the categories as they're used in plugin arguments.
+const char *category_option_name(EventCategory cat) {
+  static const char *strings[CATEGORY_COUNT] = {
+      "tu",                 "preprocess",      "function",
+      "struct",             "namespace",       "gimple_pass",
+      "rtl_pass",           "simple_ipa_pass", "ipa_pass",
+      "optimize",           "timevar",         "externis",
+      "header",             "macro",           "instantiate_function",
+      "instantiate_member", "template",        "unknown"};
+  return strings[(int)cat];
+}
+
+bool parse_count(const char *value, int64_t *count) {
+  if (!value) {
+    return false;
+  }
+  char *end;
+  long long amount = strtoll(value, &end, 10);
+  if (end == value || *end || amount < 0) {
+    return false;
+  }
+  *count = amount;
+  return true;
+}
+
+// Matches keys like "min-duration" and "min-duration-function". Sets
+// *category to CATEGORY_COUNT if the key applies to all categories.
+bool match_category_key(const char *key, const char *prefix, int *category) {
+  size_t prefix_length = strlen(prefix);
+  if (strncmp(key, prefix, prefix_length)) {
+    return false;
+  }
+  key += prefix_length;
+  if (!*key) {
+    *category = CATEGORY_COUNT;
+    return true;
+  }
+  if (*key != '-') {
+    return false;
+  }
+  for (int cat = 0; cat < CATEGORY_COUNT; ++cat) {
+    if (!strcmp(key + 1, category_option_name((EventCategory)cat))) {
+      *category = cat;
+      return true;
+    }
+  }
+  return false;
+}
+
+int process_id() {
+  static int pid = getpid();
+  return pid;
+}
+
+void write_event(const TraceEvent &event) {
+  static int UID = 0;
+  if (writer_thread) {
+    queue_command(
+        WriterCommand{WriterCommand::EVENT, event, process_id(), UID++});
+  } else {
+    writer->write_event(event, process_id(), event.tid, UID++);
+  }
+}
+
+void write_retained_events() {
+  for (auto &retained : retained_events) {
+    for (const auto &event : retained.heap) {
+      write_event(event);
+    }
+    retained.heap.clear();
+  }
+}
+
+// Writes the time spent in our callbacks and in write_all_events itself. These
+// are always written, regardless of filtering. Each callback gets an event
+// as long as the total time spent in it, laid out back to back below the
+// overall event.
+void write_overhead_events(TimeStamp serialization_start) {
+  set_track_name(EXTERNIS_TID, "externis");
+  TimeStamp callbacks_ns = 0;
+  for (int cb = 0; cb < CALLBACK_COUNT; ++cb) {
+    const auto &overhead = callback_overhead[cb];
+    if (!overhead.calls) {
+      continue;
+    }
+    TraceEvent event{callback_name((PluginCallback)cb),
+                     EventCategory::EXTERNIS,
+                     {callbacks_ns + 1, callbacks_ns + overhead.total_ns},
+                     {},
+                     EXTERNIS_TID};
+    event.args.add_int("calls", overhead.calls);
+    event.args.add_int("total_ns", overhead.total_ns);
+    write_event(event);
+    callbacks_ns += overhead.total_ns;
+  }
+  TimeStamp now = ns_from_start();
+  TimeStamp serialization_ns = now - serialization_start;
+
+  TraceEvent event{
+      "externis overhead", EventCategory::EXTERNIS, {0, now + 1}, {},
+      EXTERNIS_TID};
+  event.args.add_int("callbacks_ns", callbacks_ns);
+  event.args.add_int("write_all_events_ns", serialization_ns);
+  event.args.add_int("total_ns", callbacks_ns + serialization_ns);
+  event.args.add_double("overhead_percent",
+                        100.0 * (callbacks_ns + serialization_ns) /
+                            std::max<TimeStamp>(now, 1));
+  add_clock_args(event.args);
+  write_event(event);
+  write_event(TraceEvent{"write_all_events",
+                         EventCategory::EXTERNIS,
+                         {serialization_start, now},
+                         {},
+                         EXTERNIS_TID});
+}
+
+} // namespace
 
 const char *category_string(EventCategory cat) {
-  static const char *strings[10] = {
-      "TU",          "PREPROCESS", "FUNCTION",        "STRUCT",  "NAMESPACE",
-      "GIMPLE_PASS", "RTL_PASS",   "SIMPLE_IPA_PASS", "IPA_PAS", "UNKNOWN"};
+  static const char *strings[CATEGORY_COUNT] = {
+      "TU",                 "PREPROCESS",      "FUNCTION",
+      "STRUCT",             "NAMESPACE",       "GIMPLE_PASS",
+      "RTL_PASS",           "SIMPLE_IPA_PASS", "IPA_PAS",
+      "OPTIMIZE",           "TIMEVAR",         "EXTERNIS",
+      "HEADER",             "MACRO",           "INSTANTIATE_FUNCTION",
+      "INSTANTIATE_MEMBER", "TEMPLATE",        "UNKNOWN"};
   return strings[(int)cat];
 }
 
-json::object *new_event(const TraceEvent &event, int pid, int tid, TimeStamp ts,
-                        const char *phase, int this_uid) {
-  json::object *json_event = new json::object;
-  json_event->set("name", new json::string(event.name));
-  json_event->set("ph", new json::string(phase));
-  json_event->set("cat", new json::string(category_string(event.category)));
-  // Timestamps are in nanoseconds, JSON format is in microseconds.
-  json_event->set("ts",
-                  new json::float_number(static_cast<double>(ts) * 0.001L));
-  json_event->set("pid", new json::integer_number(pid));
-  json_event->set("tid", new json::integer_number(tid));
-  json::object *args = new json::object();
-  args->set("UID", new json::integer_number(this_uid));
-  if (event.args) {
-    for (auto &[key, value] : *event.args) {
-      args->set(key.data(), new json::string(value.data()));
+bool set_output_format(const char *format) {
+  if (!strcmp(format, "json")) {
+    output_format = OutputFormat::JSON;
+  } else if (!strcmp(format, "perfetto")) {
+    output_format = OutputFormat::PERFETTO;
+  } else if (!strcmp(format, "summary")) {
+    output_format = OutputFormat::SUMMARY;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool set_compression(const char *name) {
+  if (!strcmp(name, "none")) {
+    compression = Compression::NONE;
+  } else if (!strcmp(name, "gzip")) {
+    compression = Compression::GZIP;
+  } else if (!strcmp(name, "zstd")) {
+    compression = Compression::ZSTD;
+  } else {
+    return false;
+  }
+  compression_set = true;
+  return true;
+}
+
+void set_compression_from_file_name(const char *file_name) {
+  if (compression_set) {
+    return;
+  }
+  std::string_view name = file_name;
+  if (name.ends_with(".gz")) {
+    compression = Compression::GZIP;
+  } else if (name.ends_with(".zst")) {
+    compression = Compression::ZSTD;
+  }
+}
+
+const char *output_file_extension() {
+  return TRACE_FILE_EXTENSIONS[(int)output_format][(int)compression];
+}
+
+void set_complete_events(bool enabled) { complete_events = enabled; }
+
+bool set_filter_option(const char *key, const char *value) {
+  int category;
+  int64_t parsed;
+  if (match_category_key(key, "min-duration", &category)) {
+    if (!parse_duration(value, &parsed)) {
+      return false;
+    }
+    (category == CATEGORY_COUNT ? default_minimum_length_ns
+                                : minimum_length_ns[category]) = parsed;
+    return true;
+  }
+  if (match_category_key(key, "top-n", &category)) {
+    if (!parse_count(value, &parsed)) {
+      return false;
     }
+    (category == CATEGORY_COUNT ? default_top_n : top_n[category]) = parsed;
+    return true;
+  }
+  return false;
+}
+
+namespace {
+
+void open_output(std::unique_ptr<OutputSink> sink) {
+  output.open(std::move(sink));
+  switch (output_format) {
+  case OutputFormat::JSON:
+    writer = make_json_writer(output, complete_events);
+    break;
+  case OutputFormat::PERFETTO:
+    writer = make_perfetto_writer(output);
+    break;
+  case OutputFormat::SUMMARY:
+    writer = make_json_summary_writer(output);
+    break;
+  }
+  writer->write_header();
+
+  // The summary is written at the end, so there's nothing to stream.
+  if (use_writer_thread && !summary_mode()) {
+    writer_queue = new WriterQueue;
+    writer_thread = new std::thread(run_writer_thread);
+  }
+
+  for (int cat = 0; cat < CATEGORY_COUNT; ++cat) {
+    retained_events[cat].limit = top_n[cat] < 0 ? default_top_n : top_n[cat];
+    retained_events[cat].heap.reserve(retained_events[cat].limit);
   }
-  json_event->set("args", args);
-  return json_event;
 }
+
 } // namespace
 
-void set_output_file(FILE *file) {
-  trace_file = file;
-  output_json = new json::object();
-  output_json->set("displayTimeUnit", new json::string("ns"));
-  output_json->set("beginningOfTime",
-                   new json::integer_number(
-                       std::chrono::duration_cast<std::chrono::microseconds>(
-                           COMPILATION_START.time_since_epoch())
-                           .count()));
-  output_json->set("traceEvents", new json::array());
+bool set_output_file(FILE *file) {
+  std::unique_ptr<OutputSink> sink = make_output_sink(file, compression);
+  if (!sink) {
+    fprintf(stderr, "Externis Error! This build of externis doesn't support "
+                    "zstd compression\n");
+    fclose(file);
+    return false;
+  }
+  open_output(std::move(sink));
+  return true;
+}
+
+bool set_output_socket(const char *path) {
+  // The collector concatenates the packets of all the compilations it's
+  // sent, so only uncompressed Perfetto traces can be streamed to it.
+  // setup_output rejects any other format or compression that was asked for.
+  output_format = OutputFormat::PERFETTO;
+  compression = Compression::NONE;
+  std::unique_ptr<OutputSink> sink = make_socket_sink(path);
+  if (!sink) {
+    return false;
+  }
+  open_output(std::move(sink));
+  return true;
+}
+
+void set_process_name(const char *name) {
+  if (writer_thread) {
+    TraceEvent event{name, EventCategory::UNKNOWN, {}};
+    queue_command(
+        WriterCommand{WriterCommand::PROCESS_NAME, event, process_id(), 0});
+  } else {
+    writer->write_process_name(process_id(), name);
+  }
+}
+
+void set_track_name(int tid, const char *name) {
+  if (writer_thread) {
+    TraceEvent event{name, EventCategory::UNKNOWN, {}, {}, tid};
+    queue_command(
+        WriterCommand{WriterCommand::THREAD_NAME, event, process_id(), 0});
+  } else {
+    writer->write_thread_name(process_id(), tid, name);
+  }
+}
+
+void write_counters(const TraceEvent &event) {
+  if (writer_thread) {
+    queue_command(
+        WriterCommand{WriterCommand::COUNTERS, event, process_id(), 0});
+  } else {
+    writer->write_counters(event, process_id());
+  }
+}
+
+void set_writer_thread(bool enabled) { use_writer_thread = enabled; }
+
+bool set_max_buffered_events(const char *value) {
+  return parse_count(value, &buffered_events_limit);
+}
+
+size_t max_buffered_events() { return buffered_events_limit; }
+
+bool summary_mode() { return output_format == OutputFormat::SUMMARY; }
+
+void write_summary_table(const char *table,
+                         const std::vector<SummaryRow> &rows) {
+  writer->write_summary_table(table, rows);
+}
+
+bool events_are_streamed() { return writer_thread; }
 
-  output_events_list = (json::array *)output_json->get("traceEvents");
+bool should_keep_event(EventCategory category, TimeSpan ts) {
+  TimeStamp length = ts.end - ts.start;
+  if (length < minimum_length(category)) {
+    return false;
+  }
+  const auto &retained = retained_events[category];
+  return !retained.limit || retained.heap.size() < retained.limit ||
+         length > duration(retained.heap.front());
 }
 
 void add_event(const TraceEvent &event) {
-  static int pid = getpid();
-  static int tid = 0;
-  static int UID = 0;
-  if ((event.ts.end - event.ts.start) < MINIMUM_EVENT_LENGTH_NS) {
+  // Instant events have no duration to filter them by.
+  if (event.instant) {
+    write_event(event);
+    return;
+  }
+  if (!should_keep_event(event.category, event.ts)) {
+    return;
+  }
+  auto &retained = retained_events[event.category];
+  if (!retained.limit) {
+    write_event(event);
     return;
   }
-  int this_uid = UID++;
-  output_events_list->append(
-      new_event(event, pid, tid, event.ts.start, "B", this_uid));
-  output_events_list->append(
-      new_event(event, pid, tid, event.ts.end, "E", this_uid));
+  if (retained.heap.size() == retained.limit) {
+    std::pop_heap(retained.heap.begin(), retained.heap.end(), longer);
+    retained.heap.pop_back();
+  }
+  retained.heap.push_back(event);
+  std::push_heap(retained.heap.begin(), retained.heap.end(), longer);
 }
 
 void write_all_events() {
-  add_event(
-      TraceEvent{"TU", EventCategory::TU, {0, ns_from_start()}, std::nullopt});
+  TimeStamp serialization_start = ns_from_start();
+  TraceEvent tu{"TU", EventCategory::TU, {0, ns_from_start()}};
+  add_preprocessing_stats(tu.args);
+  add_buffering_stats(tu.args);
+  if (summary_mode()) {
+    write_event(tu); // The summary always has the TU's totals.
+  } else {
+    add_event(tu);
+  }
   write_preprocessing_events();
-  write_opt_pass_events();
-  write_all_functions();
-  write_all_scopes();
-
-#if GCCPLUGIN_VERSION_MAJOR >= 14
-  output_json->dump(trace_file, /*formatted=*/false);
-#else
-  output_json->dump(trace_file);
-#endif
-  fclose(trace_file);
-
-  output_events_list = nullptr;
-  delete output_json;
+  write_header_db();
+  write_finished_events();
+  write_timevar_events();
+  write_macro_events();
+  if (summary_mode()) {
+    write_summary_tables();
+  }
+  write_retained_events();
+  write_overhead_events(serialization_start);
+
+  if (writer_thread) {
+    queue_command(WriterCommand{WriterCommand::STOP, {}, 0, 0});
+    writer_thread->join();
+    delete writer_thread;
+    writer_thread = nullptr;
+    delete writer_queue;
+    writer_queue = nullptr;
+  }
+
+  writer->write_footer();
+  writer.reset();
+  output.close();
 }
 
 } // namespace externis
@@ -0,0 +1,118 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "externis.h"
+
+#include <cstring>
+#include <memory>
+
+namespace externis {
+
+enum class Compression { NONE, GZIP, ZSTD };
+
+// Where the bytes of the trace file end up. Compressing sinks compress the
+// data as it is written, so the trace never exists uncompressed on disk.
+class OutputSink {
+public:
+  virtual ~OutputSink() = default;
+  virtual void write(const char *data, size_t size) = 0;
+  // Writes everything that is still pending and closes the file.
+  virtual void close() = 0;
+};
+
+// Returns nullptr if the compression isn't supported by this build.
+std::unique_ptr<OutputSink> make_output_sink(std::FILE *file,
+                                             Compression compression);
+// Connects to a collector listening on a Unix domain socket. Returns nullptr
+// if it can't.
+std::unique_ptr<OutputSink> make_socket_sink(const char *path);
+
+// Trace files are written through this buffer, which is flushed to the sink
+// whenever it fills up. This keeps the memory we use independent of the
+// number of events we write.
+class OutputBuffer {
+public:
+  void open(std::unique_ptr<OutputSink> output_sink) {
+    sink = std::move(output_sink);
+    used = 0;
+  }
+
+  void write(const char *data, size_t size) {
+    if (used + size > BUFFER_SIZE) {
+      flush();
+      if (size > BUFFER_SIZE) {
+        sink->write(data, size);
+        return;
+      }
+    }
+    memcpy(buffer + used, data, size);
+    used += size;
+  }
+
+  void write(const char *str) { write(str, strlen(str)); }
+  void write(char c) { write(&c, 1); }
+
+  void flush() {
+    if (used) {
+      sink->write(buffer, used);
+    }
+    used = 0;
+  }
+
+  void close() {
+    flush();
+    sink->close();
+    sink.reset();
+  }
+
+private:
+  static constexpr size_t BUFFER_SIZE = 1 << 16;
+  char buffer[BUFFER_SIZE];
+  size_t used = 0;
+  std::unique_ptr<OutputSink> sink;
+};
+
+// A serialization format for the trace file. Every event that survives
+// filtering in add_event is handed to exactly one writer.
+class TraceWriter {
+public:
+  virtual ~TraceWriter() = default;
+  virtual void write_header() = 0;
+  virtual void write_event(const TraceEvent &event, int pid, int tid,
+                           int uid) = 0;
+  virtual void write_thread_name(int pid, int tid, const char *name) = 0;
+  virtual void write_process_name(int pid, const char *name) = 0;
+  virtual void write_counters(const TraceEvent &event, int pid) = 0;
+  // Only written in summary mode.
+  virtual void write_summary_table(const char *table,
+                                   const std::vector<SummaryRow> &rows) {}
+  virtual void write_footer() = 0;
+};
+
+std::unique_ptr<TraceWriter> make_json_writer(OutputBuffer &output,
+                                              bool complete_events);
+std::unique_ptr<TraceWriter> make_perfetto_writer(OutputBuffer &output);
+// Writes the summary tables, and the totals of the TU and overhead events.
+// Everything else is dropped.
+std::unique_ptr<TraceWriter> make_json_summary_writer(OutputBuffer &output);
+
+const char *category_string(EventCategory cat);
+
+} // namespace externis
@@ -0,0 +1,217 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "output.h"
+
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef EXTERNIS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace externis {
+
+namespace {
+
+void write_to_file(std::FILE *file, const char *data, size_t size) {
+  if (size && fwrite(data, 1, size, file) != size) {
+    perror("Externis error! Couldn't write trace file: ");
+  }
+}
+
+class FileSink : public OutputSink {
+public:
+  explicit FileSink(std::FILE *file) : file(file) {}
+
+  void write(const char *data, size_t size) override {
+    write_to_file(file, data, size);
+  }
+
+  void close() override { fclose(file); }
+
+private:
+  std::FILE *file;
+};
+
+constexpr size_t COMPRESSED_BUFFER_SIZE = 1 << 16;
+
+class GzipSink : public OutputSink {
+public:
+  explicit GzipSink(std::FILE *file) : file(file) {
+    // 16 + MAX_WBITS asks zlib for a gzip header instead of a zlib one.
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      fprintf(stderr, "Externis Error! Couldn't initialize zlib\n");
+    }
+  }
+
+  void write(const char *data, size_t size) override {
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+    stream.avail_in = size;
+    deflate_pending(Z_NO_FLUSH);
+  }
+
+  void close() override {
+    deflate_pending(Z_FINISH);
+    deflateEnd(&stream);
+    fclose(file);
+  }
+
+private:
+  // Compresses all of the pending input. With Z_FINISH this also writes the
+  // end of the stream.
+  void deflate_pending(int flush) {
+    int result;
+    do {
+      stream.next_out = reinterpret_cast<Bytef *>(buffer);
+      stream.avail_out = COMPRESSED_BUFFER_SIZE;
+      result = deflate(&stream, flush);
+      if (result == Z_STREAM_ERROR) {
+        fprintf(stderr, "Externis Error! zlib failed to compress the trace\n");
+        return;
+      }
+      write_to_file(file, buffer, COMPRESSED_BUFFER_SIZE - stream.avail_out);
+    } while (stream.avail_out == 0 ||
+             (flush == Z_FINISH && result != Z_STREAM_END));
+  }
+
+  std::FILE *file;
+  z_stream stream{};
+  char buffer[COMPRESSED_BUFFER_SIZE];
+};
+
+#ifdef EXTERNIS_HAVE_ZSTD
+class ZstdSink : public OutputSink {
+public:
+  explicit ZstdSink(std::FILE *file)
+      : file(file), context(ZSTD_createCCtx()) {}
+
+  void write(const char *data, size_t size) override {
+    ZSTD_inBuffer input{data, size, 0};
+    while (input.pos < input.size) {
+      compress(&input, ZSTD_e_continue);
+    }
+  }
+
+  void close() override {
+    ZSTD_inBuffer input{nullptr, 0, 0};
+    while (compress(&input, ZSTD_e_end)) {
+    }
+    ZSTD_freeCCtx(context);
+    fclose(file);
+  }
+
+private:
+  // Returns how much of the frame zstd still has to write, or 0 on errors.
+  size_t compress(ZSTD_inBuffer *input, ZSTD_EndDirective mode) {
+    ZSTD_outBuffer output{buffer, COMPRESSED_BUFFER_SIZE, 0};
+    size_t remaining = ZSTD_compressStream2(context, &output, input, mode);
+    if (ZSTD_isError(remaining)) {
+      fprintf(stderr, "Externis Error! zstd failed to compress the trace: %s\n",
+              ZSTD_getErrorName(remaining));
+      input->pos = input->size;
+      return 0;
+    }
+    write_to_file(file, buffer, output.pos);
+    return remaining;
+  }
+
+  std::FILE *file;
+  ZSTD_CCtx *context;
+  char buffer[COMPRESSED_BUFFER_SIZE];
+};
+#endif
+
+// A collector that goes away shouldn't fail the compilation, so after the
+// first error the rest of the trace is dropped.
+class SocketSink : public OutputSink {
+public:
+  explicit SocketSink(int fd) : fd(fd) {}
+
+  void write(const char *data, size_t size) override {
+    while (size && fd != -1) {
+      ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("Externis error! Couldn't write to the collector: ");
+        ::close(fd);
+        fd = -1;
+        return;
+      }
+      data += sent;
+      size -= sent;
+    }
+  }
+
+  void close() override {
+    if (fd != -1) {
+      ::close(fd);
+    }
+  }
+
+private:
+  int fd;
+};
+
+} // namespace
+
+std::unique_ptr<OutputSink> make_socket_sink(const char *path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Externis Error! Socket path %s is too long\n", path);
+    return nullptr;
+  }
+  strcpy(address.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 ||
+      connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address))) {
+    fprintf(stderr, "Externis Error! Couldn't connect to the collector at %s: "
+                    "%s\n",
+            path, strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return nullptr;
+  }
+  return std::make_unique<SocketSink>(fd);
+}
+
+std::unique_ptr<OutputSink> make_output_sink(std::FILE *file,
+                                             Compression compression) {
+  switch (compression) {
+  case Compression::NONE:
+    return std::make_unique<FileSink>(file);
+  case Compression::GZIP:
+    return std::make_unique<GzipSink>(file);
+  case Compression::ZSTD:
+#ifdef EXTERNIS_HAVE_ZSTD
+    return std::make_unique<ZstdSink>(file);
+#else
+    return nullptr;
+#endif
+  }
+  return nullptr;
+}
+
+} // namespace externis
@@ -0,0 +1,122 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "externis.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace externis {
+
+namespace {
+
+struct PerfCounter {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+const PerfCounter PERF_COUNTERS[PERF_COUNTER_COUNT] = {
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+// All counters are in one group with the first one as the leader, so they're
+// scheduled together and a single read() returns all of them.
+int group_fd = -1;
+int counter_fds[PERF_COUNTER_COUNT];
+
+int open_counter(const PerfCounter &counter, int leader_fd) {
+  perf_event_attr attr{};
+  attr.size = sizeof(attr);
+  attr.type = counter.type;
+  attr.config = counter.config;
+  attr.disabled = leader_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, leader_fd, 0);
+}
+
+void close_counters() {
+  for (int &fd : counter_fds) {
+    if (fd != -1) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  group_fd = -1;
+}
+
+} // namespace
+
+bool enable_perf_counters() {
+  for (int &fd : counter_fds) {
+    fd = -1;
+  }
+  for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+    counter_fds[i] = open_counter(PERF_COUNTERS[i], group_fd);
+    if (counter_fds[i] == -1) {
+      perror("Externis warning: Couldn't open hardware performance counters, "
+             "they won't be recorded: ");
+      close_counters();
+      return false;
+    }
+    if (i == 0) {
+      group_fd = counter_fds[0];
+    }
+  }
+  ioctl(group_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return true;
+}
+
+bool perf_counters_enabled() { return group_fd != -1; }
+
+PerfCounts read_perf_counters() {
+  PerfCounts counts;
+  struct {
+    uint64_t count;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[PERF_COUNTER_COUNT];
+  } group;
+  if (read(group_fd, &group, sizeof(group)) != sizeof(group)) {
+    return counts;
+  }
+  // If the PMU is shared with other groups, the counters only ran part of the
+  // time and we extrapolate.
+  double scale = group.time_running
+                     ? double(group.time_enabled) / group.time_running
+                     : 0;
+  for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+    counts.values[i] = group.values[i] * scale;
+  }
+  return counts;
+}
+
+void add_perf_counter_args(EventArgs &args, const PerfCounts &delta) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+    args.add_int(PERF_COUNTERS[i].name, delta.values[i]);
+  }
+}
+
+} // namespace externis
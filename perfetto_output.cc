@@ -0,0 +1,273 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "output.h"
+#include "perfetto_proto.h"
+
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+namespace externis {
+
+namespace {
+
+// All of our packets are written on a single sequence, so event names,
+// categories and argument names only have to be written once each. It's
+// numbered after the process, so the traces of many compilations can be
+// streamed into one file (see set_output_socket) without mixing up their
+// interned data.
+uint64_t sequence_id() {
+  static uint64_t id = getpid();
+  return id;
+}
+
+class PerfettoWriter : public TraceWriter {
+public:
+  explicit PerfettoWriter(OutputBuffer &output) : output(output) {}
+
+  void write_header() override {
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID,
+                        sequence_id());
+    append_varint_field(packet, proto::PACKET_SEQUENCE_FLAGS,
+                        proto::SEQ_INCREMENTAL_STATE_CLEARED);
+    write_packet();
+  }
+
+  void write_event(const TraceEvent &event, int pid, int tid,
+                   int uid) override {
+    uint64_t track = track_uuid(pid, tid);
+
+    interned_data.clear();
+    uint64_t name_iid =
+        intern(event_names, event.name, proto::INTERNED_EVENT_NAMES);
+    uint64_t category_iid =
+        intern(event_categories, category_string(event.category),
+               proto::INTERNED_EVENT_CATEGORIES);
+
+    track_event.clear();
+    append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                        event.instant ? proto::TYPE_INSTANT
+                                      : proto::TYPE_SLICE_BEGIN);
+    append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID, track);
+    append_varint_field(track_event, proto::TRACK_EVENT_CATEGORY_IIDS,
+                        category_iid);
+    append_varint_field(track_event, proto::TRACK_EVENT_NAME_IID, name_iid);
+
+    annotation.clear();
+    append_varint_field(annotation, proto::DEBUG_ANNOTATION_NAME_IID,
+                        intern(annotation_names, "UID",
+                               proto::INTERNED_DEBUG_ANNOTATION_NAMES));
+    append_varint_field(annotation, proto::DEBUG_ANNOTATION_INT_VALUE, uid);
+    append_message_field(track_event, proto::TRACK_EVENT_DEBUG_ANNOTATIONS,
+                         annotation);
+    for (const EventArg &arg : event.args) {
+      annotation.clear();
+      append_varint_field(annotation, proto::DEBUG_ANNOTATION_NAME_IID,
+                          intern(annotation_names, arg.key,
+                                 proto::INTERNED_DEBUG_ANNOTATION_NAMES));
+      switch (arg.type) {
+      case EventArg::INT:
+        append_varint_field(annotation, proto::DEBUG_ANNOTATION_INT_VALUE,
+                            arg.int_value);
+        break;
+      case EventArg::DOUBLE:
+        append_double_field(annotation, proto::DEBUG_ANNOTATION_DOUBLE_VALUE,
+                            arg.double_value);
+        break;
+      case EventArg::STRING:
+        append_string_field(annotation, proto::DEBUG_ANNOTATION_STRING_VALUE,
+                            arg.string_value);
+        break;
+      }
+      append_message_field(track_event, proto::TRACK_EVENT_DEBUG_ANNOTATIONS,
+                           annotation);
+    }
+    write_track_event(event.ts.start);
+    if (event.instant) {
+      return;
+    }
+
+    interned_data.clear();
+    track_event.clear();
+    append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                        proto::TYPE_SLICE_END);
+    append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID, track);
+    write_track_event(event.ts.end);
+  }
+
+  void write_thread_name(int pid, int tid, const char *name) override {
+    write_track_descriptor(pid, tid, name);
+  }
+
+  void write_process_name(int pid, const char *name) override {
+    std::string process;
+    append_varint_field(process, proto::PROCESS_DESCRIPTOR_PID, pid);
+    append_string_field(process, proto::PROCESS_DESCRIPTOR_PROCESS_NAME, name);
+    std::string descriptor;
+    append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID,
+                        make_track_uuid(pid, -1));
+    append_message_field(descriptor, proto::TRACK_DESCRIPTOR_PROCESS, process);
+
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID,
+                        sequence_id());
+    append_message_field(packet, proto::PACKET_TRACK_DESCRIPTOR, descriptor);
+    write_packet();
+  }
+
+  // Every counter gets its own counter track, below the thread's track.
+  void write_counters(const TraceEvent &event, int pid) override {
+    for (const EventArg &arg : event.args) {
+      if (arg.type != EventArg::INT) {
+        continue;
+      }
+      interned_data.clear();
+      track_event.clear();
+      append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                          proto::TYPE_COUNTER);
+      append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID,
+                          counter_track_uuid(pid, event.tid, arg.key));
+      append_varint_field(track_event, proto::TRACK_EVENT_COUNTER_VALUE,
+                          arg.int_value);
+      write_track_event(event.ts.start);
+    }
+  }
+
+  void write_footer() override {}
+
+private:
+  uint64_t intern(map_t<std::string, uint64_t> &table, const char *str,
+                  int interned_field) {
+    auto [it, inserted] = table.try_emplace(str, table.size() + 1);
+    if (inserted) {
+      interned_entry.clear();
+      append_varint_field(interned_entry, proto::INTERNED_IID, it->second);
+      append_string_field(interned_entry, proto::INTERNED_NAME, str);
+      append_message_field(interned_data, interned_field, interned_entry);
+    }
+    return it->second;
+  }
+
+  static uint64_t make_track_uuid(int pid, int tid) {
+    return (static_cast<uint64_t>(pid) << 32) | static_cast<uint32_t>(tid + 1);
+  }
+
+  uint64_t track_uuid(int pid, int tid) {
+    uint64_t uuid = make_track_uuid(pid, tid);
+    if (!known_tracks.contains(uuid)) {
+      write_track_descriptor(pid, tid, nullptr);
+    }
+    return uuid;
+  }
+
+  // Counter tracks are numbered from the top of the tid range down, so they
+  // can't collide with thread tracks.
+  uint64_t counter_track_uuid(int pid, int tid, const char *name) {
+    auto [it, inserted] = counter_tracks.try_emplace(
+        name, make_track_uuid(pid, -2 - (int)counter_tracks.size()));
+    if (inserted) {
+      std::string descriptor;
+      append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID, it->second);
+      append_string_field(descriptor, proto::TRACK_DESCRIPTOR_NAME, name);
+      append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_PARENT_UUID,
+                          track_uuid(pid, tid));
+      append_message_field(descriptor, proto::TRACK_DESCRIPTOR_COUNTER, "");
+
+      packet.clear();
+      append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID,
+                          sequence_id());
+      append_message_field(packet, proto::PACKET_TRACK_DESCRIPTOR, descriptor);
+      write_packet();
+    }
+    return it->second;
+  }
+
+  void write_track_descriptor(int pid, int tid, const char *thread_name) {
+    uint64_t uuid = make_track_uuid(pid, tid);
+    known_tracks.insert(uuid);
+
+    std::string thread;
+    append_varint_field(thread, proto::THREAD_DESCRIPTOR_PID, pid);
+    append_varint_field(thread, proto::THREAD_DESCRIPTOR_TID, tid);
+    if (thread_name) {
+      append_string_field(thread, proto::THREAD_DESCRIPTOR_THREAD_NAME,
+                          thread_name);
+    }
+    std::string descriptor;
+    append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID, uuid);
+    append_message_field(descriptor, proto::TRACK_DESCRIPTOR_THREAD, thread);
+
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID,
+                        sequence_id());
+    append_message_field(packet, proto::PACKET_TRACK_DESCRIPTOR, descriptor);
+    write_packet();
+  }
+
+  void write_track_event(TimeStamp ts) {
+    packet.clear();
+    // Perfetto wants absolute timestamps in nanoseconds.
+    append_varint_field(packet, proto::PACKET_TIMESTAMP, start_ns + ts);
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID,
+                        sequence_id());
+    append_varint_field(packet, proto::PACKET_SEQUENCE_FLAGS,
+                        proto::SEQ_NEEDS_INCREMENTAL_STATE);
+    if (!interned_data.empty()) {
+      append_message_field(packet, proto::PACKET_INTERNED_DATA, interned_data);
+    }
+    append_message_field(packet, proto::PACKET_TRACK_EVENT, track_event);
+    write_packet();
+  }
+
+  void write_packet() {
+    std::string header;
+    append_tag(header, proto::TRACE_PACKET, LENGTH_DELIMITED);
+    append_varint(header, packet.size());
+    output.write(header.data(), header.size());
+    output.write(packet.data(), packet.size());
+  }
+
+  OutputBuffer &output;
+  const uint64_t start_ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          COMPILATION_START.time_since_epoch())
+          .count();
+
+  map_t<std::string, uint64_t> event_names;
+  map_t<std::string, uint64_t> event_categories;
+  map_t<std::string, uint64_t> annotation_names;
+  set_t<uint64_t> known_tracks;
+  map_t<std::string, uint64_t> counter_tracks;
+
+  // Scratch buffers for the messages we're building, reused between events.
+  std::string packet;
+  std::string track_event;
+  std::string interned_data;
+  std::string interned_entry;
+  std::string annotation;
+};
+
+} // namespace
+
+std::unique_ptr<TraceWriter> make_perfetto_writer(OutputBuffer &output) {
+  return std::make_unique<PerfettoWriter>(output);
+}
+
+} // namespace externis
@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace externis {
+
+// Just enough of the protobuf wire format to write Perfetto traces. We only
+// ever need varints, doubles and length-delimited fields, so there's no reason
+// to depend on libprotobuf. Shared by the plugin and the tools.
+enum WireType { VARINT = 0, FIXED64 = 1, LENGTH_DELIMITED = 2 };
+
+inline void append_varint(std::string &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+inline void append_tag(std::string &out, int field, WireType type) {
+  append_varint(out, (static_cast<uint64_t>(field) << 3) | type);
+}
+
+inline void append_varint_field(std::string &out, int field, uint64_t value) {
+  append_tag(out, field, VARINT);
+  append_varint(out, value);
+}
+
+inline void append_double_field(std::string &out, int field, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  append_tag(out, field, FIXED64);
+  for (int i = 0; i < 8; ++i) {
+    out.push_back(static_cast<char>(bits >> (8 * i)));
+  }
+}
+
+inline void append_bytes_field(std::string &out, int field, const char *data,
+                               size_t size) {
+  append_tag(out, field, LENGTH_DELIMITED);
+  append_varint(out, size);
+  out.append(data, size);
+}
+
+inline void append_string_field(std::string &out, int field, const char *str) {
+  append_bytes_field(out, field, str, strlen(str));
+}
+
+inline void append_message_field(std::string &out, int field,
+                                 const std::string &message) {
+  append_bytes_field(out, field, message.data(), message.size());
+}
+
+// Field numbers and enum values from perfetto/protos/perfetto/trace/.
+namespace proto {
+constexpr int TRACE_PACKET = 1;
+
+constexpr int PACKET_TIMESTAMP = 8;
+constexpr int PACKET_TRUSTED_SEQUENCE_ID = 10;
+constexpr int PACKET_TRACK_EVENT = 11;
+constexpr int PACKET_INTERNED_DATA = 12;
+constexpr int PACKET_SEQUENCE_FLAGS = 13;
+constexpr int PACKET_TRACK_DESCRIPTOR = 60;
+
+constexpr int SEQ_INCREMENTAL_STATE_CLEARED = 1;
+constexpr int SEQ_NEEDS_INCREMENTAL_STATE = 2;
+
+constexpr int TRACK_EVENT_CATEGORY_IIDS = 3;
+constexpr int TRACK_EVENT_DEBUG_ANNOTATIONS = 4;
+constexpr int TRACK_EVENT_TYPE = 9;
+constexpr int TRACK_EVENT_NAME_IID = 10;
+constexpr int TRACK_EVENT_TRACK_UUID = 11;
+constexpr int TRACK_EVENT_COUNTER_VALUE = 30;
+constexpr int TRACK_EVENT_DOUBLE_COUNTER_VALUE = 44;
+
+constexpr int TYPE_SLICE_BEGIN = 1;
+constexpr int TYPE_SLICE_END = 2;
+constexpr int TYPE_INSTANT = 3;
+constexpr int TYPE_COUNTER = 4;
+
+constexpr int DEBUG_ANNOTATION_NAME_IID = 1;
+constexpr int DEBUG_ANNOTATION_BOOL_VALUE = 2;
+constexpr int DEBUG_ANNOTATION_INT_VALUE = 4;
+constexpr int DEBUG_ANNOTATION_DOUBLE_VALUE = 5;
+constexpr int DEBUG_ANNOTATION_STRING_VALUE = 6;
+
+constexpr int INTERNED_EVENT_CATEGORIES = 1;
+constexpr int INTERNED_EVENT_NAMES = 2;
+constexpr int INTERNED_DEBUG_ANNOTATION_NAMES = 3;
+constexpr int INTERNED_IID = 1;
+constexpr int INTERNED_NAME = 2;
+
+constexpr int TRACK_DESCRIPTOR_UUID = 1;
+constexpr int TRACK_DESCRIPTOR_NAME = 2;
+constexpr int TRACK_DESCRIPTOR_PROCESS = 3;
+constexpr int TRACK_DESCRIPTOR_THREAD = 4;
+constexpr int TRACK_DESCRIPTOR_PARENT_UUID = 5;
+constexpr int TRACK_DESCRIPTOR_COUNTER = 8;
+constexpr int PROCESS_DESCRIPTOR_PID = 1;
+constexpr int PROCESS_DESCRIPTOR_PROCESS_NAME = 6;
+constexpr int THREAD_DESCRIPTOR_PID = 1;
+constexpr int THREAD_DESCRIPTOR_TID = 2;
+constexpr int THREAD_DESCRIPTOR_THREAD_NAME = 5;
+} // namespace proto
+
+} // namespace externis
@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace externis {
+
+// A lock-free queue for exactly one producer thread and one consumer thread.
+// The producer and the consumer each keep a cached copy of the other side's
+// index, so in the common case a push or a pop doesn't touch the other
+// thread's cache line at all.
+template <class T, size_t Capacity> class SpscRingBuffer {
+  static_assert((Capacity & (Capacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+public:
+  // Producer only. Returns false if the buffer is full.
+  bool try_push(T &&value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - cached_head >= Capacity) {
+      cached_head = head_.load(std::memory_order_acquire);
+      if (tail - cached_head >= Capacity) {
+        return false;
+      }
+    }
+    slots[tail & (Capacity - 1)] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    tail_.notify_one();
+    return true;
+  }
+
+  // Consumer only. Returns false if the buffer is empty.
+  bool try_pop(T &value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == cached_tail) {
+      cached_tail = tail_.load(std::memory_order_acquire);
+      if (head == cached_tail) {
+        return false;
+      }
+    }
+    value = std::move(slots[head & (Capacity - 1)]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Blocks until the buffer isn't empty.
+  void wait_for_push() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    tail_.wait(head, std::memory_order_acquire);
+  }
+
+private:
+  alignas(64) std::atomic<size_t> head_{0};
+  size_t cached_tail = 0;
+  alignas(64) std::atomic<size_t> tail_{0};
+  size_t cached_head = 0;
+  alignas(64) std::array<T, Capacity> slots;
+};
+
+} // namespace externis
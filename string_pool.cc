@@ -0,0 +1,85 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "externis.h"
+
+#include <memory>
+#include <vector>
+
+namespace externis {
+
+namespace {
+
+// Interned strings are copied into large chunks that are never freed or
+// moved, so the pointers we hand out stay valid until the plugin exits.
+constexpr size_t CHUNK_SIZE = 1 << 16;
+
+struct StringPool {
+  std::vector<std::unique_ptr<char[]>> chunks;
+  size_t chunk_used = CHUNK_SIZE;
+  // Strings too big to share a chunk get an allocation of their own.
+  std::vector<std::unique_ptr<char[]>> large_strings;
+
+  map_t<std::string_view, StringId> string_ids;
+  std::vector<const char *> strings;
+
+  const char *copy_to_arena(std::string_view str) {
+    size_t size = str.size() + 1;
+    char *copy;
+    if (size > CHUNK_SIZE / 4) {
+      large_strings.emplace_back(new char[size]);
+      copy = large_strings.back().get();
+    } else {
+      if (chunk_used + size > CHUNK_SIZE) {
+        chunks.emplace_back(new char[CHUNK_SIZE]);
+        chunk_used = 0;
+      }
+      copy = chunks.back().get() + chunk_used;
+      chunk_used += size;
+    }
+    memcpy(copy, str.data(), str.size());
+    copy[str.size()] = '\0';
+    return copy;
+  }
+};
+
+// Other translation units intern strings during static initialization, so the
+// pool is constructed on first use.
+StringPool &pool() {
+  static StringPool string_pool;
+  return string_pool;
+}
+
+} // namespace
+
+StringId intern(std::string_view str) {
+  StringPool &strings = pool();
+  auto it = strings.string_ids.find(str);
+  if (it != strings.string_ids.end()) {
+    return it->second;
+  }
+  const char *copy = strings.copy_to_arena(str);
+  StringId id = strings.strings.size();
+  strings.strings.push_back(copy);
+  strings.string_ids.emplace(std::string_view(copy, str.size()), id);
+  return id;
+}
+
+const char *interned_string(StringId id) { return pool().strings[id]; }
+
+} // namespace externis
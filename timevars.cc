@@ -0,0 +1,148 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <gcc-plugin.h>
+
+#include "externis.h"
+
+#include <algorithm>
+#include <options.h>
+#include <timevar.h>
+#include <vector>
+
+namespace externis {
+
+namespace {
+
+struct TimevarTotal {
+  std::string name;
+  double user_seconds;
+  double sys_seconds;
+  double wall_seconds;
+  std::string ggc_memory;
+};
+
+bool timevars_enabled = false;
+
+// GCC doesn't expose the timevar values to plugins, only the -ftime-report
+// table. So we print it to memory and parse it back. Rows look like
+//  phase parsing              :   0.20 ( 50%)   0.05 ( 40%)   0.26 ( 48%)  20M ( 45%)
+std::vector<TimevarTotal> read_timevars() {
+  std::vector<TimevarTotal> totals;
+  char *report = nullptr;
+  size_t report_size = 0;
+  FILE *stream = open_memstream(&report, &report_size);
+  if (!stream) {
+    return totals;
+  }
+  g_timer->print(stream);
+  fclose(stream);
+
+  char *saveptr;
+  for (char *line = strtok_r(report, "\n", &saveptr); line;
+       line = strtok_r(nullptr, "\n", &saveptr)) {
+    char *colon = strchr(line, ':');
+    if (!colon) {
+      continue;
+    }
+    TimevarTotal total;
+    double ggc_amount;
+    char ggc_unit;
+    if (sscanf(colon + 1, "%lf (%*f%%) %lf (%*f%%) %lf (%*f%%) %lf%c",
+               &total.user_seconds, &total.sys_seconds, &total.wall_seconds,
+               &ggc_amount, &ggc_unit) != 5) {
+      continue;
+    }
+    std::string_view name(line, colon - line);
+    name.remove_prefix(std::min(name.find_first_not_of(' '), name.size()));
+    name.remove_suffix(name.size() - name.find_last_not_of(' ') - 1);
+    if (name.empty() || name == "TOTAL") {
+      continue;
+    }
+    total.name = name;
+    char ggc[32];
+    snprintf(ggc, sizeof(ggc), "%.0f%c", ggc_amount,
+             ggc_unit == ' ' ? '\0' : ggc_unit);
+    total.ggc_memory = ggc;
+    totals.push_back(std::move(total));
+  }
+  free(report);
+  return totals;
+}
+
+// Timevar totals don't say when things happened, so each group is laid out
+// back to back from the start of the compilation. Phases are measured
+// independently of the other timevars, and each of the two groups adds up to
+// the total compilation time.
+void write_timevar_track(const std::vector<TimevarTotal> &totals, int tid,
+                         bool phases) {
+  TimeStamp ts = 0;
+  for (const auto &total : totals) {
+    if (total.name.starts_with("phase ") != phases) {
+      continue;
+    }
+    TimeStamp duration = total.wall_seconds * 1e9;
+    TraceEvent event{interned_string(intern(total.name)),
+                     EventCategory::TIMEVAR,
+                     {ts + 1, ts + duration},
+                     {},
+                     tid};
+    event.args.add_double("user_seconds", total.user_seconds);
+    event.args.add_double("sys_seconds", total.sys_seconds);
+    event.args.add_double("wall_seconds", total.wall_seconds);
+    event.args.add_string("ggc_memory",
+                          interned_string(intern(total.ggc_memory)));
+    add_event(event);
+    ts += duration;
+  }
+}
+
+} // namespace
+
+void enable_timevars() {
+  timevars_enabled = true;
+  // This makes GCC keep its timevars like it does for -ftime-report.
+  timevar_init();
+}
+
+void write_timevar_events() {
+  if (!timevars_enabled || !g_timer) {
+    return;
+  }
+  auto totals = read_timevars();
+  if (totals.empty()) {
+    fprintf(stderr, "Externis warning: Couldn't parse GCC's timevars\n");
+  }
+  std::stable_sort(totals.begin(), totals.end(),
+                   [](const TimevarTotal &lhs, const TimevarTotal &rhs) {
+                     return lhs.wall_seconds > rhs.wall_seconds;
+                   });
+  set_track_name(TIMEVAR_PHASES_TID, "GCC phases");
+  write_timevar_track(totals, TIMEVAR_PHASES_TID, /*phases=*/true);
+  set_track_name(TIMEVARS_TID, "GCC timevars");
+  write_timevar_track(totals, TIMEVARS_TID, /*phases=*/false);
+
+  // If GCC wasn't going to report the timevars itself, we don't want the
+  // report printed when GCC exits.
+  if (!time_report && quiet_flag && !flag_detailed_statistics) {
+    delete g_timer;
+    g_timer = nullptr;
+  }
+}
+
+} // namespace externis
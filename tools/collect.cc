@@ -0,0 +1,385 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// externis-collect: the other end of -fplugin-arg-externis-socket. Listens on
+// a Unix domain socket and concatenates the Perfetto traces that the
+// compilations on this host stream to it into one trace file, as they arrive.
+//
+// Every compilation writes its packets on its own sequence, so the trace is
+// valid as long as packets aren't torn apart: each connection's bytes are
+// buffered until a whole packet is there, and only whole packets are written.
+// The collector adds a "running compilations" counter of its own.
+
+#include "perfetto_proto.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace externis::tools {
+
+namespace {
+
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) { stop_requested = 1; }
+
+struct Client {
+  int fd;
+  pid_t pid;
+  // Bytes of a packet that hasn't fully arrived yet.
+  std::string pending = {};
+  int64_t bytes = 0;
+  int64_t packets = 0;
+};
+
+// How long poll() waits before the output is flushed, so the file can be
+// opened while the build is still running.
+constexpr int FLUSH_INTERVAL_MS = 100;
+constexpr size_t READ_SIZE = 1 << 16;
+
+class Collector {
+public:
+  explicit Collector(std::FILE *out) : out(out) {
+    sequence_id = getpid();
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID, sequence_id);
+    append_varint_field(packet, proto::PACKET_SEQUENCE_FLAGS,
+                        proto::SEQ_INCREMENTAL_STATE_CLEARED);
+    write_packet();
+
+    std::string descriptor;
+    append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID,
+                        RUNNING_TRACK_UUID);
+    append_string_field(descriptor, proto::TRACK_DESCRIPTOR_NAME,
+                        "running compilations");
+    append_message_field(descriptor, proto::TRACK_DESCRIPTOR_COUNTER, "");
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID, sequence_id);
+    append_message_field(packet, proto::PACKET_TRACK_DESCRIPTOR, descriptor);
+    write_packet();
+  }
+
+  void connected() { write_running_counter(++running); }
+
+  // Returns false if the client sent something that isn't a trace packet.
+  bool received(Client &client, const char *data, size_t size) {
+    client.bytes += size;
+    client.pending.append(data, size);
+    size_t written = 0;
+    size_t packet_size;
+    bool valid = true;
+    while ((packet_size = complete_packet(client.pending, written, &valid))) {
+      fwrite(client.pending.data() + written, 1, packet_size, out);
+      written += packet_size;
+      ++client.packets;
+    }
+    client.pending.erase(0, written);
+    return valid;
+  }
+
+  void disconnected(const Client &client) {
+    if (!client.pending.empty()) {
+      fprintf(stderr,
+              "externis-collect: dropped %zu bytes of a partial packet from "
+              "pid %d\n",
+              client.pending.size(), client.pid);
+    }
+    ++finished;
+    total_bytes += client.bytes;
+    total_packets += client.packets;
+    write_running_counter(--running);
+  }
+
+  int64_t running = 0;
+  int64_t finished = 0;
+  int64_t total_bytes = 0;
+  int64_t total_packets = 0;
+
+private:
+  // Track uuids are the pid in the top half, and pid 0 never compiles
+  // anything, so this can't collide with the tracks of the compilations.
+  static constexpr uint64_t RUNNING_TRACK_UUID = 0xffffffff;
+
+  // The size of the packet at offset, including its tag and length, or 0 if
+  // it hasn't arrived yet.
+  static size_t complete_packet(const std::string &data, size_t offset,
+                                bool *valid) {
+    if (offset == data.size()) {
+      return 0;
+    }
+    if (static_cast<uint8_t>(data[offset]) !=
+        ((proto::TRACE_PACKET << 3) | LENGTH_DELIMITED)) {
+      *valid = false;
+      return 0;
+    }
+    uint64_t length = 0;
+    size_t position = offset + 1;
+    for (int shift = 0; position < data.size(); shift += 7) {
+      uint8_t byte = data[position++];
+      length |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        if (data.size() - position < length) {
+          return 0;
+        }
+        return position + length - offset;
+      }
+      if (shift > 63) {
+        *valid = false;
+        return 0;
+      }
+    }
+    return 0;
+  }
+
+  void write_running_counter(int64_t value) {
+    // Same clock the plugin's timestamps are based on.
+    int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::high_resolution_clock::now()
+                             .time_since_epoch())
+                         .count();
+    std::string track_event;
+    append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                        proto::TYPE_COUNTER);
+    append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID,
+                        RUNNING_TRACK_UUID);
+    append_varint_field(track_event, proto::TRACK_EVENT_COUNTER_VALUE, value);
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TIMESTAMP, now_ns);
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID, sequence_id);
+    append_varint_field(packet, proto::PACKET_SEQUENCE_FLAGS,
+                        proto::SEQ_NEEDS_INCREMENTAL_STATE);
+    append_message_field(packet, proto::PACKET_TRACK_EVENT, track_event);
+    write_packet();
+  }
+
+  void write_packet() {
+    std::string header;
+    append_tag(header, proto::TRACE_PACKET, LENGTH_DELIMITED);
+    append_varint(header, packet.size());
+    fwrite(header.data(), 1, header.size(), out);
+    fwrite(packet.data(), 1, packet.size(), out);
+  }
+
+  std::FILE *out;
+  uint64_t sequence_id;
+  std::string packet;
+};
+
+int listen_on(const char *path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "externis-collect: socket path %s is too long\n", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  // A collector that was killed leaves its socket behind.
+  struct stat st;
+  if (!stat(path, &st) && S_ISSOCK(st.st_mode)) {
+    unlink(path);
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 ||
+      bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) ||
+      listen(fd, SOMAXCONN)) {
+    fprintf(stderr, "externis-collect: couldn't listen on %s: %s\n", path,
+            strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+pid_t peer_pid(int fd) {
+  ucred credentials{};
+  socklen_t size = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size)) {
+    return 0;
+  }
+  return credentials.pid;
+}
+
+void print_usage() {
+  fprintf(stderr,
+          "Usage: externis-collect -o OUTPUT [--connections=N] [--progress] "
+          "SOCKET\n"
+          "\n"
+          "Listens on the Unix domain socket SOCKET and writes the traces of "
+          "all the\ncompilations built with "
+          "-fplugin-arg-externis-socket=SOCKET into one Perfetto\ntrace, "
+          "while they run. Stops on SIGINT or SIGTERM.\n"
+          "\n"
+          "  -o OUTPUT        Where to write the trace.\n"
+          "  --connections=N  Stop once N compilations have finished.\n"
+          "  --progress       Print a line for every finished compilation.\n");
+}
+
+} // namespace
+
+int collect_main(int argc, char **argv) {
+  const char *output_path = nullptr;
+  const char *socket_path = nullptr;
+  int64_t max_connections = 0;
+  bool progress = false;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "-o") && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (!strncmp(arg, "--connections=", 14)) {
+      char *end;
+      max_connections = strtoll(arg + 14, &end, 10);
+      if (*end || max_connections <= 0) {
+        fprintf(stderr, "externis-collect: invalid %s\n", arg);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--progress")) {
+      progress = true;
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      print_usage();
+      return 0;
+    } else if (arg[0] == '-' && arg[1]) {
+      fprintf(stderr, "externis-collect: unknown option %s\n", arg);
+      print_usage();
+      return 2;
+    } else if (!socket_path) {
+      socket_path = arg;
+    } else {
+      print_usage();
+      return 2;
+    }
+  }
+  if (!output_path || !socket_path) {
+    print_usage();
+    return 2;
+  }
+
+  std::FILE *out = fopen(output_path, "wb");
+  if (!out) {
+    fprintf(stderr, "externis-collect: couldn't open %s\n", output_path);
+    return 1;
+  }
+  int listener = listen_on(socket_path);
+  if (listener == -1) {
+    fclose(out);
+    return 1;
+  }
+  struct sigaction action{};
+  action.sa_handler = request_stop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  Collector collector(out);
+  std::vector<Client> clients;
+  std::vector<pollfd> fds;
+  std::vector<char> buffer(READ_SIZE);
+  while (!stop_requested &&
+         (!max_connections || collector.finished < max_connections)) {
+    fds.clear();
+    fds.push_back(pollfd{listener, POLLIN, 0});
+    for (const Client &client : clients) {
+      fds.push_back(pollfd{client.fd, POLLIN, 0});
+    }
+    int ready = poll(fds.data(), fds.size(), FLUSH_INTERVAL_MS);
+    if (ready < 0) {
+      if (errno != EINTR) {
+        perror("externis-collect: poll");
+        break;
+      }
+      continue;
+    }
+    if (!ready) {
+      fflush(out);
+      continue;
+    }
+    // Clients are handled before accepting new ones, so fds[i + 1] still
+    // matches clients[i].
+    for (size_t i = clients.size(); i-- > 0;) {
+      if (!fds[i + 1].revents) {
+        continue;
+      }
+      Client &client = clients[i];
+      ssize_t size = read(client.fd, buffer.data(), buffer.size());
+      if (size < 0 && errno == EINTR) {
+        continue;
+      }
+      if (size > 0 && collector.received(client, buffer.data(), size)) {
+        continue;
+      }
+      if (size > 0) {
+        fprintf(stderr,
+                "externis-collect: pid %d didn't send a Perfetto trace, "
+                "dropping it\n",
+                client.pid);
+      }
+      collector.disconnected(client);
+      if (progress) {
+        fprintf(stderr,
+                "externis-collect: pid %d finished, %" PRId64
+                " bytes; %" PRId64 " running, %" PRId64 " finished\n",
+                client.pid, client.bytes, collector.running,
+                collector.finished);
+      }
+      close(client.fd);
+      clients.erase(clients.begin() + i);
+    }
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd != -1) {
+        clients.push_back(Client{.fd = fd, .pid = peer_pid(fd)});
+        collector.connected();
+      }
+    }
+  }
+
+  close(listener);
+  unlink(socket_path);
+  for (Client &client : clients) {
+    collector.disconnected(client);
+    close(client.fd);
+  }
+  if (progress) {
+    fprintf(stderr,
+            "externis-collect: %" PRId64 " compilations, %" PRId64
+            " packets, %" PRId64 " bytes\n",
+            collector.finished, collector.total_packets, collector.total_bytes);
+  }
+  if (fclose(out)) {
+    fprintf(stderr, "externis-collect: couldn't write the trace\n");
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace externis::tools
+
+int main(int argc, char **argv) {
+  return externis::tools::collect_main(argc, argv);
+}
@@ -0,0 +1,421 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// externis-diff: compares the traces of two builds, to find out what got
+// slower. Events are matched by their category and name, and passes also by
+// their static_pass_number, and then summed over all the traces of each side.
+// Every event's self time is its time minus the time of the events directly
+// nested in it, found with the same sweep as externis-validate (intervals.h).
+
+#include "duration.h"
+#include "intervals.h"
+#include "trace_files.h"
+#include "trace_reader.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace externis::tools {
+
+namespace {
+
+struct Times {
+  int64_t self_ns = 0;
+  int64_t inclusive_ns = 0;
+  int64_t count = 0;
+};
+
+// These are summaries of other events, or aren't measured in time.
+const std::unordered_set<std::string> IGNORED_CATEGORIES = {
+    "EXTERNIS", "HEADER", "MACRO", "TEMPLATE"};
+
+// Reads the traces of one side of the comparison.
+class Side : public IntervalBuilder {
+public:
+  explicit Side(std::vector<std::string> &keys,
+                std::unordered_map<std::string, uint32_t> &key_ids)
+      : keys(keys), key_ids(key_ids) {}
+
+  bool read(const std::string &path) {
+    TraceReader reader;
+    if (!reader.open(path.c_str())) {
+      fprintf(stderr, "externis-diff: %s\n", reader.error().c_str());
+      return false;
+    }
+    Event event;
+    while (reader.next(event)) {
+      add(event);
+    }
+    if (!reader.error().empty()) {
+      fprintf(stderr, "externis-diff: %s\n", reader.error().c_str());
+      return false;
+    }
+    finish();
+    for (auto &[track, intervals] : tracks) {
+      sum(intervals);
+    }
+    tracks.clear();
+    ++traces;
+    return true;
+  }
+
+  // Zero for events that aren't in any of this side's traces.
+  Times times(uint32_t key) const {
+    auto it = totals.find(key);
+    return it == totals.end() ? Times{} : it->second;
+  }
+
+  int64_t traces = 0;
+
+private:
+  void sum(std::vector<Interval> &intervals) {
+    sweep_nesting(intervals, [](Interval &interval, Interval *parent) {
+      if (parent) {
+        parent->children_ns += interval.end_ns - interval.start_ns;
+      }
+      return true;
+    });
+    for (const Interval &interval : intervals) {
+      Times &times = totals[interval.id];
+      int64_t length = interval.end_ns - interval.start_ns;
+      times.inclusive_ns += length;
+      times.self_ns += std::max<int64_t>(length - interval.children_ns, 0);
+      ++times.count;
+    }
+  }
+
+  // Events of one category with the same name are the same thing in both
+  // builds. A pass can run under the same name more than once in the
+  // pipeline, so its static_pass_number tells its instances apart.
+  uint32_t interval_id(const Event &event) override {
+    if (IGNORED_CATEGORIES.contains(event.cat)) {
+      return SKIP;
+    }
+    std::string text = event.cat;
+    text += '\t';
+    text += event.name;
+    const JsonValue *pass_number = event.arg("static_pass_number");
+    if (pass_number && pass_number->type == JsonValue::INT) {
+      text += " #" + std::to_string(pass_number->int_value);
+    }
+    auto [it, inserted] = key_ids.try_emplace(text, keys.size());
+    if (inserted) {
+      keys.push_back(text);
+    }
+    return it->second;
+  }
+
+  std::vector<std::string> &keys;
+  std::unordered_map<std::string, uint32_t> &key_ids;
+  std::unordered_map<uint32_t, Times> totals;
+};
+
+// A directory stands for all the JSON traces in it, with any compression.
+bool trace_paths(const char *path, std::vector<std::string> &paths) {
+  std::error_code error;
+  if (!std::filesystem::is_directory(path, error)) {
+    paths.push_back(path);
+    return true;
+  }
+  for (const auto &entry : std::filesystem::directory_iterator(path, error)) {
+    OutputFormat format;
+    if (!entry.is_regular_file() ||
+        !trace_file_format(entry.path().filename().string(), &format)) {
+      continue;
+    }
+    if (format == OutputFormat::JSON) {
+      paths.push_back(entry.path().string());
+    } else {
+      fprintf(stderr,
+              "externis-diff: skipping %s, only JSON traces can be compared\n",
+              entry.path().c_str());
+    }
+  }
+  if (error) {
+    fprintf(stderr, "externis-diff: couldn't read %s: %s\n", path,
+            error.message().c_str());
+    return false;
+  }
+  std::sort(paths.begin(), paths.end());
+  return true;
+}
+
+struct Row {
+  uint32_t key;
+  Times before;
+  Times after;
+};
+
+int64_t metric(const Times &times, bool self) {
+  return self ? times.self_ns : times.inclusive_ns;
+}
+
+int64_t delta(const Row &row, bool self) {
+  return metric(row.after, self) - metric(row.before, self);
+}
+
+// New events are infinitely slower.
+double relative_change(const Row &row, bool self) {
+  int64_t before = metric(row.before, self);
+  if (!before) {
+    return delta(row, self) > 0 ? INFINITY : 0;
+  }
+  return static_cast<double>(delta(row, self)) / before;
+}
+
+std::string format_change(double change) {
+  if (std::isinf(change)) {
+    return "new";
+  }
+  char text[32];
+  snprintf(text, sizeof(text), "%+.1f%%", 100 * change);
+  return text;
+}
+
+void print_rows(const char *title, const std::vector<const Row *> &rows,
+                const std::vector<std::string> &keys, bool self) {
+  printf("\n%s:\n", title);
+  if (rows.empty()) {
+    printf("  none\n");
+    return;
+  }
+  const char *other = self ? "incl" : "self";
+  printf("%12s %12s %12s %8s %12s %8s  %-20s %s\n", "before ms", "after ms",
+         "delta ms", "change", other, "change", "category", "name");
+  for (const Row *row : rows) {
+    const std::string &key = keys[row->key];
+    size_t tab = key.find('\t');
+    printf("%12.3f %12.3f %+12.3f %8s %+12.3f %8s  %-20s %s\n",
+           metric(row->before, self) / 1e6, metric(row->after, self) / 1e6,
+           delta(*row, self) / 1e6,
+           format_change(relative_change(*row, self)).c_str(),
+           delta(*row, !self) / 1e6,
+           format_change(relative_change(*row, !self)).c_str(),
+           key.substr(0, tab).c_str(), key.c_str() + tab + 1);
+  }
+}
+
+void print_usage() {
+  fprintf(stderr,
+          "Usage: externis-diff [--top=N] [--metric=self|inclusive] "
+          "[--min-delta=DURATION]\n"
+          "                     [--category=CATEGORY]... "
+          "[--fail-above=PERCENT] [--tsv]\n"
+          "                     BEFORE AFTER\n"
+          "\n"
+          "Compares the externis JSON traces of two builds. BEFORE and AFTER "
+          "are traces,\nor directories of traces whose totals are compared. "
+          "Events are matched by\ncategory and name (and static_pass_number "
+          "for passes), and the largest\nregressions are printed.\n"
+          "\n"
+          "  --top=N          Rows per table. Default: 20, 0 for all.\n"
+          "  --metric         What to compare. Default: self, the time of an "
+          "event\n"
+          "                   without the events nested in it.\n"
+          "  --min-delta      Smaller regressions aren't ranked by their "
+          "relative\n"
+          "                   change, and don't fail --fail-above. Default: "
+          "1ms.\n"
+          "  --category       Only compare events of these categories, like "
+          "PREPROCESS.\n"
+          "  --fail-above     Exit with 1 if anything regressed by more than "
+          "PERCENT.\n"
+          "  --tsv            Print every matched event as tab separated "
+          "values, with\n"
+          "                   times in nanoseconds.\n");
+}
+
+} // namespace
+
+int diff_main(int argc, char **argv) {
+  size_t top = 20;
+  bool self = true;
+  int64_t min_delta_ns = 1000000;
+  double fail_above = -1;
+  bool tsv = false;
+  std::unordered_set<std::string> categories;
+  std::vector<const char *> sides;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strncmp(arg, "--top=", 6)) {
+      top = strtoull(arg + 6, nullptr, 10);
+    } else if (!strcmp(arg, "--metric=self")) {
+      self = true;
+    } else if (!strcmp(arg, "--metric=inclusive")) {
+      self = false;
+    } else if (!strncmp(arg, "--min-delta=", 12)) {
+      if (!parse_duration(arg + 12, &min_delta_ns)) {
+        fprintf(stderr, "externis-diff: invalid %s\n", arg);
+        return 2;
+      }
+    } else if (!strncmp(arg, "--category=", 11)) {
+      categories.insert(arg + 11);
+    } else if (!strncmp(arg, "--fail-above=", 13)) {
+      char *end;
+      fail_above = strtod(arg + 13, &end);
+      if (end == arg + 13 || *end || fail_above < 0) {
+        fprintf(stderr, "externis-diff: invalid %s\n", arg);
+        return 2;
+      }
+    } else if (!strcmp(arg, "--tsv")) {
+      tsv = true;
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      print_usage();
+      return 0;
+    } else if (arg[0] == '-' && arg[1]) {
+      fprintf(stderr, "externis-diff: unknown option %s\n", arg);
+      print_usage();
+      return 2;
+    } else {
+      sides.push_back(arg);
+    }
+  }
+  if (sides.size() != 2) {
+    print_usage();
+    return 2;
+  }
+
+  // Both sides share the keys, so matching events is comparing ids.
+  std::vector<std::string> keys;
+  std::unordered_map<std::string, uint32_t> key_ids;
+  Side before(keys, key_ids);
+  Side after(keys, key_ids);
+  for (auto [path, side] : {std::pair{sides[0], &before}, {sides[1], &after}}) {
+    std::vector<std::string> paths;
+    if (!trace_paths(path, paths)) {
+      return 1;
+    }
+    if (paths.empty()) {
+      fprintf(stderr, "externis-diff: no traces in %s\n", path);
+      return 1;
+    }
+    for (const std::string &trace : paths) {
+      if (!side->read(trace)) {
+        return 1;
+      }
+    }
+  }
+
+  std::vector<Row> rows;
+  for (uint32_t key = 0; key < keys.size(); ++key) {
+    if (!categories.empty() &&
+        !categories.contains(keys[key].substr(0, keys[key].find('\t')))) {
+      continue;
+    }
+    rows.push_back(Row{key, before.times(key), after.times(key)});
+  }
+
+  if (tsv) {
+    printf("category\tname\tbefore_self_ns\tafter_self_ns\t"
+           "before_inclusive_ns\tafter_inclusive_ns\tbefore_count\t"
+           "after_count\n");
+    for (const Row &row : rows) {
+      const std::string &key = keys[row.key];
+      size_t tab = key.find('\t');
+      printf("%s\t%s\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64
+             "\t%" PRId64 "\t%" PRId64 "\n",
+             key.substr(0, tab).c_str(), key.c_str() + tab + 1,
+             row.before.self_ns, row.after.self_ns, row.before.inclusive_ns,
+             row.after.inclusive_ns, row.before.count, row.after.count);
+    }
+  } else {
+    auto tu = key_ids.find("TU\tTU");
+    if (tu != key_ids.end()) {
+      uint32_t key = tu->second;
+      Row total{key, before.times(key), after.times(key)};
+      printf("%" PRId64 " -> %" PRId64 " traces, TU time %.3fs -> %.3fs "
+             "(%s)\n",
+             before.traces, after.traces, total.before.inclusive_ns / 1e9,
+             total.after.inclusive_ns / 1e9,
+             format_change(relative_change(total, false)).c_str());
+    }
+
+    std::vector<const Row *> regressions;
+    for (const Row &row : rows) {
+      if (delta(row, self) > 0) {
+        regressions.push_back(&row);
+      }
+    }
+    auto limit = [top](std::vector<const Row *> &ranked) {
+      if (top && ranked.size() > top) {
+        ranked.resize(top);
+      }
+    };
+    std::vector<const Row *> absolute = regressions;
+    std::sort(absolute.begin(), absolute.end(),
+              [self](const Row *lhs, const Row *rhs) {
+                return delta(*lhs, self) > delta(*rhs, self);
+              });
+    limit(absolute);
+    std::vector<const Row *> relative;
+    for (const Row *row : regressions) {
+      if (delta(*row, self) >= min_delta_ns) {
+        relative.push_back(row);
+      }
+    }
+    std::sort(relative.begin(), relative.end(),
+              [self](const Row *lhs, const Row *rhs) {
+                double lhs_change = relative_change(*lhs, self);
+                double rhs_change = relative_change(*rhs, self);
+                if (lhs_change != rhs_change) {
+                  return lhs_change > rhs_change;
+                }
+                return delta(*lhs, self) > delta(*rhs, self);
+              });
+    limit(relative);
+    const char *metric_name = self ? "self time" : "inclusive time";
+    print_rows((std::string("Largest absolute regressions in ") + metric_name)
+                   .c_str(),
+               absolute, keys, self);
+    print_rows((std::string("Largest relative regressions in ") + metric_name)
+                   .c_str(),
+               relative, keys, self);
+  }
+
+  if (fail_above < 0) {
+    return 0;
+  }
+  fflush(stdout);
+  int status = 0;
+  for (const Row &row : rows) {
+    double change = relative_change(row, self);
+    if (delta(row, self) >= min_delta_ns && 100 * change > fail_above) {
+      const std::string &key = keys[row.key];
+      fprintf(stderr, "externis-diff: %s regressed by %s (%+.3fms)\n",
+              key.c_str() + key.find('\t') + 1, format_change(change).c_str(),
+              delta(row, self) / 1e6);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+} // namespace externis::tools
+
+int main(int argc, char **argv) {
+  return externis::tools::diff_main(argc, argv);
+}
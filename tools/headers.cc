@@ -0,0 +1,286 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// externis-headers: ranks the headers in a header database (written with
+// -fplugin-arg-externis-header-db) by their cost over the whole build.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace externis::tools {
+
+namespace {
+
+struct HeaderTotal {
+  std::string name;
+  int64_t self_ns = 0;
+  int64_t inclusive_ns = 0;
+  int64_t inclusions = 0;
+  // The number of TUs that include the header.
+  int64_t tus = 0;
+  // The block of the last TU counted in tus. Different paths of one header
+  // can have their own lines in a TU.
+  int64_t last_block = -1;
+};
+
+enum class SortKey { SELF, INCLUSIVE, INCLUSIONS, TUS };
+
+int64_t sort_value(const HeaderTotal &total, SortKey key) {
+  switch (key) {
+  case SortKey::SELF:
+    return total.self_ns;
+  case SortKey::INCLUSIVE:
+    return total.inclusive_ns;
+  case SortKey::INCLUSIONS:
+    return total.inclusions;
+  case SortKey::TUS:
+    return total.tus;
+  }
+  return 0;
+}
+
+// Reads the databases twice. The first pass finds the last block of each TU,
+// because TUs that are compiled again append a new block, and the second pass
+// only sums those blocks. Blocks are numbered across all the databases, in
+// the order they're given, so a TU is only counted once even if it's in more
+// than one of them.
+class HeaderDb {
+public:
+  bool read(const std::vector<const char *> &paths) {
+    int64_t block = 0;
+    for (const char *path : paths) {
+      std::FILE *file = open(path);
+      if (!file) {
+        return false;
+      }
+      for_each_line(file, [&](char type, const char *rest) {
+        if (type == 'T') {
+          last_block[tu_name(rest)] = block++;
+        }
+      });
+      fclose(file);
+    }
+    block = 0;
+    for (const char *path : paths) {
+      std::FILE *file = open(path);
+      if (!file) {
+        return false;
+      }
+      sum_blocks(file, block);
+      fclose(file);
+    }
+    return true;
+  }
+
+  std::vector<HeaderTotal> ranked(SortKey key) const {
+    std::vector<HeaderTotal> rows;
+    rows.reserve(totals.size());
+    for (const auto &[name, total] : totals) {
+      rows.push_back(total);
+    }
+    std::sort(rows.begin(), rows.end(),
+              [key](const HeaderTotal &lhs, const HeaderTotal &rhs) {
+                int64_t lhs_value = sort_value(lhs, key);
+                int64_t rhs_value = sort_value(rhs, key);
+                if (lhs_value != rhs_value) {
+                  return lhs_value > rhs_value;
+                }
+                return lhs.name < rhs.name;
+              });
+    return rows;
+  }
+
+  int64_t tus = 0;
+  int64_t bad_lines = 0;
+
+private:
+  // The TU's name follows its beginningOfTime.
+  static std::string tu_name(const char *rest) {
+    const char *space = strchr(rest, ' ');
+    return space ? space + 1 : "";
+  }
+
+  static std::FILE *open(const char *path) {
+    std::FILE *file = fopen(path, "r");
+    if (!file) {
+      fprintf(stderr, "externis-headers: couldn't open %s\n", path);
+    }
+    return file;
+  }
+
+  // Sums the H lines of the TUs' last blocks. block is the number of the
+  // file's first block.
+  void sum_blocks(std::FILE *file, int64_t &block) {
+    bool current = false;
+    int64_t current_block = -1;
+    for_each_line(file, [&](char type, const char *rest) {
+      if (type == 'T') {
+        current_block = block++;
+        current = last_block[tu_name(rest)] == current_block;
+        tus += current;
+        return;
+      }
+      if (type != 'H' || !current) {
+        return;
+      }
+      int64_t self_ns, inclusive_ns, inclusions;
+      int name_offset;
+      if (sscanf(rest, "%" SCNd64 " %" SCNd64 " %" SCNd64 " %n", &self_ns,
+                 &inclusive_ns, &inclusions, &name_offset) != 3) {
+        ++bad_lines;
+        return;
+      }
+      std::string name = rest + name_offset;
+      auto [it, inserted] = totals.try_emplace(name);
+      HeaderTotal &total = it->second;
+      if (inserted) {
+        total.name = std::move(name);
+      }
+      total.self_ns += self_ns;
+      total.inclusive_ns += inclusive_ns;
+      total.inclusions += inclusions;
+      if (total.last_block != current_block) {
+        total.last_block = current_block;
+        ++total.tus;
+      }
+    });
+  }
+
+  template <typename Callback>
+  void for_each_line(std::FILE *file, Callback callback) {
+    char *line = nullptr;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, file)) != -1) {
+      if (length && line[length - 1] == '\n') {
+        line[--length] = '\0';
+      }
+      if (length >= 2 && line[1] == ' ') {
+        callback(line[0], line + 2);
+      } else if (length) {
+        ++bad_lines;
+      }
+    }
+    free(line);
+  }
+
+  std::unordered_map<std::string, int64_t> last_block;
+  std::unordered_map<std::string, HeaderTotal> totals;
+};
+
+void print_usage() {
+  fprintf(stderr,
+          "Usage: externis-headers [--top=N] "
+          "[--sort=self|inclusive|inclusions|tus] [--tsv] DB...\n"
+          "\n"
+          "Ranks the headers in externis header databases by their total "
+          "cost over all\nTUs. Only the last compilation of each TU is "
+          "counted.\n"
+          "\n"
+          "  --top=N   Only print the N first headers. Default: 50, 0 for "
+          "all.\n"
+          "  --sort    What to rank by. Default: self, the preprocessing time "
+          "of the\n"
+          "            header itself, without the headers it includes.\n"
+          "  --tsv     Print tab separated values, with times in "
+          "nanoseconds.\n");
+}
+
+} // namespace
+
+int headers_main(int argc, char **argv) {
+  size_t top = 50;
+  SortKey key = SortKey::SELF;
+  bool tsv = false;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strncmp(arg, "--top=", 6)) {
+      top = strtoull(arg + 6, nullptr, 10);
+    } else if (!strcmp(arg, "--sort=self")) {
+      key = SortKey::SELF;
+    } else if (!strcmp(arg, "--sort=inclusive")) {
+      key = SortKey::INCLUSIVE;
+    } else if (!strcmp(arg, "--sort=inclusions")) {
+      key = SortKey::INCLUSIONS;
+    } else if (!strcmp(arg, "--sort=tus")) {
+      key = SortKey::TUS;
+    } else if (!strcmp(arg, "--tsv")) {
+      tsv = true;
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      print_usage();
+      return 0;
+    } else if (arg[0] == '-' && arg[1]) {
+      fprintf(stderr, "externis-headers: unknown option %s\n", arg);
+      print_usage();
+      return 2;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    print_usage();
+    return 2;
+  }
+
+  HeaderDb db;
+  if (!db.read(paths)) {
+    return 1;
+  }
+  if (db.bad_lines) {
+    fprintf(stderr, "externis-headers: skipped %" PRId64 " malformed lines\n",
+            db.bad_lines);
+  }
+
+  std::vector<HeaderTotal> rows = db.ranked(key);
+  if (top && rows.size() > top) {
+    rows.resize(top);
+  }
+  if (tsv) {
+    printf("rank\tself_ns\tinclusive_ns\tinclusions\ttus\theader\n");
+  } else {
+    printf("%" PRId64 " TUs\n\n", db.tus);
+    printf("%5s %10s %12s %10s %7s  %s\n", "rank", "self s", "inclusive s",
+           "inclusions", "TUs %", "header");
+  }
+  for (size_t i = 0; i < rows.size(); ++i) {
+    const HeaderTotal &row = rows[i];
+    if (tsv) {
+      printf("%zu\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\t%s\n",
+             i + 1, row.self_ns, row.inclusive_ns, row.inclusions, row.tus,
+             row.name.c_str());
+    } else {
+      printf("%5zu %10.3f %12.3f %10" PRId64 " %6.1f%%  %s\n", i + 1,
+             row.self_ns / 1e9, row.inclusive_ns / 1e9, row.inclusions,
+             db.tus ? 100.0 * row.tus / db.tus : 0.0, row.name.c_str());
+    }
+  }
+  return 0;
+}
+
+} // namespace externis::tools
+
+int main(int argc, char **argv) {
+  return externis::tools::headers_main(argc, argv);
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "intervals.h"
+
+namespace externis::tools {
+
+void IntervalBuilder::add(const Event &event) {
+  if (event.ph == "X") {
+    uint32_t id = interval_id(event);
+    if (id != SKIP) {
+      add_interval({event.pid, event.tid}, to_ns(event.ts),
+                   to_ns(event.ts + event.dur), id);
+    }
+  } else if (event.ph == "B") {
+    // Skipped events are still paired, so their "E" events don't end other
+    // events.
+    OpenEvent open{to_ns(event.ts), interval_id(event), {event.pid, event.tid}};
+    const JsonValue *uid = event.arg("UID");
+    if (uid && uid->type == JsonValue::INT) {
+      auto ended = ended_uids.find({event.pid, uid->int_value});
+      if (ended != ended_uids.end()) {
+        reused_uid(event, uid->int_value, ended->second);
+      }
+      auto [it, inserted] =
+          open_by_uid.try_emplace({event.pid, uid->int_value}, open);
+      if (!inserted) {
+        reused_uid(event, uid->int_value, it->second.id);
+      }
+    } else {
+      open_by_track[open.track].push_back(open);
+    }
+  } else if (event.ph == "E") {
+    end(event);
+  }
+}
+
+void IntervalBuilder::finish() {
+  for (const auto &[key, open] : open_by_uid) {
+    if (open.id != SKIP) {
+      unmatched_begin(open.id, &key.second);
+    }
+  }
+  for (const auto &[track, stack] : open_by_track) {
+    for (const OpenEvent &open : stack) {
+      if (open.id != SKIP) {
+        unmatched_begin(open.id, nullptr);
+      }
+    }
+  }
+  open_by_uid.clear();
+  ended_uids.clear();
+  open_by_track.clear();
+}
+
+void IntervalBuilder::end(const Event &event) {
+  const JsonValue *uid = event.arg("UID");
+  int64_t end_ns = to_ns(event.ts);
+  OpenEvent open;
+  if (uid && uid->type == JsonValue::INT) {
+    auto it = open_by_uid.find({event.pid, uid->int_value});
+    if (it == open_by_uid.end()) {
+      unmatched_end(event, &uid->int_value);
+      return;
+    }
+    open = it->second;
+    open_by_uid.erase(it);
+    ended_uids[{event.pid, uid->int_value}] = open.id;
+    if (open.track != Track{event.pid, event.tid}) {
+      end_on_other_thread(event, uid->int_value);
+    }
+  } else {
+    auto &stack = open_by_track[{event.pid, event.tid}];
+    if (stack.empty()) {
+      unmatched_end(event, nullptr);
+      return;
+    }
+    open = stack.back();
+    stack.pop_back();
+  }
+  if (open.id != SKIP) {
+    add_interval(open.track, open.start_ns, end_ns, open.id);
+  }
+}
+
+void IntervalBuilder::add_interval(Track track, int64_t start_ns,
+                                   int64_t end_ns, uint32_t id) {
+  if (check_interval(track, start_ns, end_ns, id)) {
+    tracks[track].push_back({start_ns, end_ns, id, 0});
+  }
+}
+
+} // namespace externis::tools
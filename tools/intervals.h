@@ -0,0 +1,127 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "trace_reader.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+// Turns the events of a trace into intervals per thread, the way the viewers
+// draw them, for the tools that look at how events nest.
+namespace externis::tools {
+
+using Track = std::pair<int64_t, int64_t>; // pid, tid
+
+struct Interval {
+  int64_t start_ns;
+  int64_t end_ns;
+  // Whatever the tool identifies the event by, like its name.
+  uint32_t id;
+  // Time spent in the intervals nested directly in this one. Filled in by
+  // the tools that need it.
+  int64_t children_ns;
+};
+
+// Timestamps in the file are in microseconds.
+inline int64_t to_ns(double us) { return std::llround(us * 1000); }
+
+// Pairs "B" and "E" events by their UID, or per thread for events without
+// one, and collects them and the "X" events into tracks. Events that can't be
+// paired are reported through the virtual functions.
+class IntervalBuilder {
+public:
+  static constexpr uint32_t SKIP = static_cast<uint32_t>(-1);
+
+  virtual ~IntervalBuilder() = default;
+
+  void add(const Event &event);
+  // Reports the "B" events that never ended.
+  void finish();
+
+  std::map<Track, std::vector<Interval>> tracks;
+
+protected:
+  // The id of a "B" or "X" event, or SKIP to ignore it.
+  virtual uint32_t interval_id(const Event &event) = 0;
+  // Called for every paired or "X" event, which is then added to its track
+  // unless this returns false.
+  virtual bool check_interval(Track /*track*/, int64_t /*start_ns*/,
+                              int64_t /*end_ns*/, uint32_t /*id*/) {
+    return true;
+  }
+  // The plugin numbers the events of a process once, so a UID can't be used
+  // again even after its event ended.
+  virtual void reused_uid(const Event & /*event*/, int64_t /*uid*/,
+                          uint32_t /*other_id*/) {}
+  // uid is nullptr for events without one.
+  virtual void unmatched_end(const Event & /*event*/,
+                             const int64_t * /*uid*/) {}
+  virtual void end_on_other_thread(const Event & /*event*/,
+                                   int64_t /*uid*/) {}
+  virtual void unmatched_begin(uint32_t /*id*/, const int64_t * /*uid*/) {}
+
+private:
+  struct OpenEvent {
+    int64_t start_ns;
+    uint32_t id;
+    Track track;
+  };
+
+  void end(const Event &event);
+  void add_interval(Track track, int64_t start_ns, int64_t end_ns,
+                    uint32_t id);
+
+  std::map<std::pair<int64_t, int64_t>, OpenEvent> open_by_uid; // pid, UID
+  std::map<std::pair<int64_t, int64_t>, uint32_t> ended_uids;   // pid, UID
+  std::map<Track, std::vector<OpenEvent>> open_by_track;
+};
+
+// Sorts the intervals of a track by start, longest first among intervals that
+// start together, and calls visit(interval, parent) for each of them. parent
+// is the interval it's directly nested in, or nullptr.
+//
+// An interval has to end before the next one starts or contain it. visit
+// returns false for an interval that overlaps its parent instead, and the
+// sweep goes on as if it had been cut short.
+template <typename Visit>
+void sweep_nesting(std::vector<Interval> &intervals, Visit visit) {
+  std::sort(intervals.begin(), intervals.end(),
+            [](const Interval &lhs, const Interval &rhs) {
+              if (lhs.start_ns != rhs.start_ns) {
+                return lhs.start_ns < rhs.start_ns;
+              }
+              return lhs.end_ns > rhs.end_ns;
+            });
+  std::vector<Interval *> stack;
+  for (Interval &interval : intervals) {
+    while (!stack.empty() && stack.back()->end_ns <= interval.start_ns) {
+      stack.pop_back();
+    }
+    if (visit(interval, stack.empty() ? nullptr : stack.back())) {
+      stack.push_back(&interval);
+    }
+  }
+}
+
+} // namespace externis::tools
@@ -0,0 +1,689 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// externis-merge: merges the per-TU traces of a build into one timeline, with
+// a process per TU. Traces are streamed one event at a time, so merging
+// thousands of them only needs memory for one event (and, with --dedup, the
+// interned names).
+
+#include "perfetto_proto.h"
+#include "trace_reader.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace externis::tools {
+
+namespace {
+
+struct Input {
+  const char *path = nullptr;
+  int64_t beginning_of_time_us = 0;
+  int pid = 0;
+  // The lto1 runs of one link are merged into a single process, where each
+  // of them gets its own range of tids.
+  bool lto = false;
+  int64_t tid_offset = 0;
+  // B and E events are paired by their pid and UID, so the lto1 runs of a
+  // link, which run in parallel, each get their own range of UIDs too.
+  int64_t uid_offset = 0;
+  std::string stage_name;
+  // Span of the TU's events on the merged timeline, in microseconds.
+  double start_us = INFINITY;
+  double end_us = -INFINITY;
+};
+
+class MergedWriter {
+public:
+  virtual ~MergedWriter() = default;
+  virtual void write_header(int64_t beginning_of_time_us) = 0;
+  // Starts the events of the next input trace.
+  virtual void start_input(int pid) = 0;
+  // ts has already been moved onto the merged timeline.
+  virtual void write_event(const Event &event, int64_t pid) = 0;
+  virtual void write_process_name(int64_t pid, const std::string &name) = 0;
+  // A counter that belongs to the whole build rather than to one TU.
+  virtual void write_build_counter(const char *name, double ts_us,
+                                   int64_t value) = 0;
+  virtual void write_footer() = 0;
+};
+
+// Writes the same JSON format as the plugin.
+class JsonMergedWriter : public MergedWriter {
+public:
+  explicit JsonMergedWriter(std::FILE *out) : out(out) {}
+
+  void write_header(int64_t beginning_of_time_us) override {
+    fprintf(out,
+            "{\"displayTimeUnit\":\"ns\",\"beginningOfTime\":%" PRId64
+            ",\"traceEvents\":[",
+            beginning_of_time_us);
+  }
+
+  void start_input(int) override {}
+
+  void write_event(const Event &event, int64_t pid) override {
+    start_event();
+    fputs("{\"name\":", out);
+    write_json_string(out, event.name);
+    if (!event.cat.empty()) {
+      fputs(",\"cat\":", out);
+      write_json_string(out, event.cat);
+    }
+    fputs(",\"ph\":", out);
+    write_json_string(out, event.ph);
+    if (event.ph != "M") {
+      fputs(",\"ts\":", out);
+      write_json_timestamp(out, event.ts);
+    }
+    if (event.has_dur) {
+      fputs(",\"dur\":", out);
+      write_json_timestamp(out, event.dur);
+    }
+    fprintf(out, ",\"pid\":%" PRId64 ",\"tid\":%" PRId64 ",\"args\":{", pid,
+            event.tid);
+    bool first_arg = true;
+    for (const auto &[key, value] : event.args) {
+      if (!first_arg) {
+        fputc(',', out);
+      }
+      first_arg = false;
+      write_json_string(out, key);
+      fputc(':', out);
+      write_json_value(out, value);
+    }
+    fputs("}}", out);
+  }
+
+  void write_process_name(int64_t pid, const std::string &name) override {
+    start_event();
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%" PRId64
+                 ",\"args\":{\"name\":",
+            pid);
+    write_json_string(out, name);
+    fputs("}}", out);
+  }
+
+  void write_build_counter(const char *name, double ts_us,
+                           int64_t value) override {
+    start_event();
+    fprintf(out, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":", name);
+    write_json_timestamp(out, ts_us);
+    fprintf(out, ",\"pid\":0,\"tid\":0,\"args\":{\"%s\":%" PRId64 "}}", name,
+            value);
+  }
+
+  void write_footer() override { fputs("]}", out); }
+
+private:
+  void start_event() {
+    if (!first_event) {
+      fputc(',', out);
+    }
+    first_event = false;
+  }
+
+  std::FILE *out;
+  bool first_event = true;
+};
+
+// Writes a Perfetto trace. Every input gets its own sequence with its own
+// interned names, unless dedup is set, in which case all inputs share a single
+// sequence and every name is only written once for the whole build. That
+// makes the trace a lot smaller, because most names (headers, passes,
+// timevars) are the same in every TU, but the interning tables have to stay in
+// memory until the end.
+class PerfettoMergedWriter : public MergedWriter {
+public:
+  PerfettoMergedWriter(std::FILE *out, bool dedup) : out(out), dedup(dedup) {}
+
+  void write_header(int64_t beginning_of_time_us) override {
+    start_ns = beginning_of_time_us * 1000;
+    if (dedup) {
+      start_sequence(1);
+    }
+  }
+
+  void start_input(int pid) override {
+    if (!dedup) {
+      event_names.clear();
+      event_categories.clear();
+      annotation_names.clear();
+      start_sequence(pid);
+    }
+  }
+
+  void write_event(const Event &event, int64_t pid) override {
+    if (event.ph == "M") {
+      const JsonValue *name = event.arg("name");
+      if (!name || name->type != JsonValue::STRING) {
+        return;
+      }
+      if (event.name == "process_name") {
+        write_process_name(pid, name->text);
+      } else if (event.name == "thread_name") {
+        write_thread_descriptor(pid, event.tid, name->text.c_str());
+      }
+      return;
+    }
+    if (event.ph == "C") {
+      for (const auto &[key, value] : event.args) {
+        write_counter(counter_track_uuid(pid, key, track_uuid(pid, event.tid)),
+                      event.ts, value);
+      }
+      return;
+    }
+    if (event.ph == "E") {
+      write_slice_end(track_uuid(pid, event.tid), event.ts);
+      return;
+    }
+    if (event.ph != "B" && event.ph != "X" && event.ph != "i") {
+      return;
+    }
+
+    uint64_t track = track_uuid(pid, event.tid);
+    interned_data.clear();
+    uint64_t name_iid =
+        intern(event_names, event.name, proto::INTERNED_EVENT_NAMES);
+    uint64_t category_iid = intern(event_categories, event.cat,
+                                   proto::INTERNED_EVENT_CATEGORIES);
+
+    track_event.clear();
+    append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                        event.ph == "i" ? proto::TYPE_INSTANT
+                                        : proto::TYPE_SLICE_BEGIN);
+    append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID, track);
+    append_varint_field(track_event, proto::TRACK_EVENT_CATEGORY_IIDS,
+                        category_iid);
+    append_varint_field(track_event, proto::TRACK_EVENT_NAME_IID, name_iid);
+    for (const auto &[key, value] : event.args) {
+      annotation.clear();
+      append_varint_field(annotation, proto::DEBUG_ANNOTATION_NAME_IID,
+                          intern(annotation_names, key,
+                                 proto::INTERNED_DEBUG_ANNOTATION_NAMES));
+      switch (value.type) {
+      case JsonValue::INT:
+        append_varint_field(annotation, proto::DEBUG_ANNOTATION_INT_VALUE,
+                            value.int_value);
+        break;
+      case JsonValue::DOUBLE:
+        append_double_field(annotation, proto::DEBUG_ANNOTATION_DOUBLE_VALUE,
+                            value.double_value);
+        break;
+      case JsonValue::BOOL:
+        append_varint_field(annotation, proto::DEBUG_ANNOTATION_BOOL_VALUE,
+                            value.int_value);
+        break;
+      case JsonValue::STRING:
+      case JsonValue::RAW:
+        append_string_field(annotation, proto::DEBUG_ANNOTATION_STRING_VALUE,
+                            value.text.c_str());
+        break;
+      case JsonValue::NUL:
+        continue;
+      }
+      append_message_field(track_event, proto::TRACK_EVENT_DEBUG_ANNOTATIONS,
+                           annotation);
+    }
+    write_track_event(event.ts);
+
+    if (event.ph == "X") {
+      write_slice_end(track, event.ts + event.dur);
+    }
+  }
+
+  void write_process_name(int64_t pid, const std::string &name) override {
+    std::string process;
+    append_varint_field(process, proto::PROCESS_DESCRIPTOR_PID, pid);
+    append_string_field(process, proto::PROCESS_DESCRIPTOR_PROCESS_NAME,
+                        name.c_str());
+    std::string descriptor;
+    append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID,
+                        make_track_uuid(pid, -1));
+    append_message_field(descriptor, proto::TRACK_DESCRIPTOR_PROCESS, process);
+    write_descriptor(descriptor);
+  }
+
+  // Build counters get top level tracks.
+  void write_build_counter(const char *name, double ts_us,
+                           int64_t value) override {
+    JsonValue json_value;
+    json_value.type = JsonValue::INT;
+    json_value.int_value = value;
+    write_counter(counter_track_uuid(0, name, 0), ts_us, json_value);
+  }
+
+  void write_footer() override {}
+
+private:
+  uint64_t intern(std::unordered_map<std::string, uint64_t> &table,
+                  const std::string &str, int interned_field) {
+    auto [it, inserted] = table.try_emplace(str, table.size() + 1);
+    if (inserted) {
+      interned_entry.clear();
+      append_varint_field(interned_entry, proto::INTERNED_IID, it->second);
+      append_string_field(interned_entry, proto::INTERNED_NAME, str.c_str());
+      append_message_field(interned_data, interned_field, interned_entry);
+    }
+    return it->second;
+  }
+
+  // The same uuids as the plugin uses, so merged and per-TU traces look the
+  // same.
+  static uint64_t make_track_uuid(int64_t pid, int64_t tid) {
+    return (static_cast<uint64_t>(pid) << 32) | static_cast<uint32_t>(tid + 1);
+  }
+
+  uint64_t track_uuid(int64_t pid, int64_t tid) {
+    uint64_t uuid = make_track_uuid(pid, tid);
+    if (!known_tracks.contains(uuid)) {
+      write_thread_descriptor(pid, tid, nullptr);
+    }
+    return uuid;
+  }
+
+  uint64_t counter_track_uuid(int64_t pid, const std::string &name,
+                              uint64_t parent) {
+    auto [it, inserted] = counter_tracks.try_emplace(
+        std::to_string(pid) + '/' + name,
+        make_track_uuid(pid, -2 - static_cast<int64_t>(counter_tracks.size())));
+    if (inserted) {
+      std::string descriptor;
+      append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID, it->second);
+      append_string_field(descriptor, proto::TRACK_DESCRIPTOR_NAME,
+                          name.c_str());
+      if (parent) {
+        append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_PARENT_UUID,
+                            parent);
+      }
+      append_message_field(descriptor, proto::TRACK_DESCRIPTOR_COUNTER, "");
+      write_descriptor(descriptor);
+    }
+    return it->second;
+  }
+
+  void write_thread_descriptor(int64_t pid, int64_t tid,
+                               const char *thread_name) {
+    uint64_t uuid = make_track_uuid(pid, tid);
+    known_tracks.insert(uuid);
+
+    std::string thread;
+    append_varint_field(thread, proto::THREAD_DESCRIPTOR_PID, pid);
+    append_varint_field(thread, proto::THREAD_DESCRIPTOR_TID, tid);
+    if (thread_name) {
+      append_string_field(thread, proto::THREAD_DESCRIPTOR_THREAD_NAME,
+                          thread_name);
+    }
+    std::string descriptor;
+    append_varint_field(descriptor, proto::TRACK_DESCRIPTOR_UUID, uuid);
+    append_message_field(descriptor, proto::TRACK_DESCRIPTOR_THREAD, thread);
+    write_descriptor(descriptor);
+  }
+
+  void start_sequence(uint64_t sequence) {
+    sequence_id = sequence;
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID, sequence_id);
+    append_varint_field(packet, proto::PACKET_SEQUENCE_FLAGS,
+                        proto::SEQ_INCREMENTAL_STATE_CLEARED);
+    write_packet();
+  }
+
+  void write_descriptor(const std::string &descriptor) {
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID, sequence_id);
+    append_message_field(packet, proto::PACKET_TRACK_DESCRIPTOR, descriptor);
+    write_packet();
+  }
+
+  void write_counter(uint64_t track, double ts_us, const JsonValue &value) {
+    interned_data.clear();
+    track_event.clear();
+    append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                        proto::TYPE_COUNTER);
+    append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID, track);
+    if (value.type == JsonValue::INT) {
+      append_varint_field(track_event, proto::TRACK_EVENT_COUNTER_VALUE,
+                          value.int_value);
+    } else {
+      append_double_field(track_event, proto::TRACK_EVENT_DOUBLE_COUNTER_VALUE,
+                          value.as_double());
+    }
+    write_track_event(ts_us);
+  }
+
+  void write_slice_end(uint64_t track, double ts_us) {
+    interned_data.clear();
+    track_event.clear();
+    append_varint_field(track_event, proto::TRACK_EVENT_TYPE,
+                        proto::TYPE_SLICE_END);
+    append_varint_field(track_event, proto::TRACK_EVENT_TRACK_UUID, track);
+    write_track_event(ts_us);
+  }
+
+  void write_track_event(double ts_us) {
+    packet.clear();
+    append_varint_field(packet, proto::PACKET_TIMESTAMP,
+                        start_ns + std::llround(ts_us * 1000));
+    append_varint_field(packet, proto::PACKET_TRUSTED_SEQUENCE_ID, sequence_id);
+    append_varint_field(packet, proto::PACKET_SEQUENCE_FLAGS,
+                        proto::SEQ_NEEDS_INCREMENTAL_STATE);
+    if (!interned_data.empty()) {
+      append_message_field(packet, proto::PACKET_INTERNED_DATA, interned_data);
+    }
+    append_message_field(packet, proto::PACKET_TRACK_EVENT, track_event);
+    write_packet();
+  }
+
+  void write_packet() {
+    std::string header;
+    append_tag(header, proto::TRACE_PACKET, LENGTH_DELIMITED);
+    append_varint(header, packet.size());
+    fwrite(header.data(), 1, header.size(), out);
+    fwrite(packet.data(), 1, packet.size(), out);
+  }
+
+  std::FILE *out;
+  const bool dedup;
+  int64_t start_ns = 0;
+  uint64_t sequence_id = 1;
+
+  std::unordered_map<std::string, uint64_t> event_names;
+  std::unordered_map<std::string, uint64_t> event_categories;
+  std::unordered_map<std::string, uint64_t> annotation_names;
+  std::unordered_set<uint64_t> known_tracks;
+  std::unordered_map<std::string, uint64_t> counter_tracks;
+
+  std::string packet;
+  std::string track_event;
+  std::string interned_data;
+  std::string interned_entry;
+  std::string annotation;
+};
+
+// LTRANS partition N gets the tids from (N + 1) * LTO_TID_STRIDE.
+constexpr int64_t LTO_TID_STRIDE = 1000;
+
+std::string string_field(const TraceReader &reader, const char *key) {
+  const JsonValue *value = reader.header_field(key);
+  return value && value->type == JsonValue::STRING ? value->text : "";
+}
+
+void read_lto_fields(const TraceReader &reader, Input &input) {
+  std::string stage = string_field(reader, "ltoStage");
+  if (stage.empty()) {
+    return;
+  }
+  input.lto = true;
+  if (stage == "ltrans") {
+    const JsonValue *partition = reader.header_field("ltoPartition");
+    int64_t number = partition ? partition->int_value : 0;
+    input.tid_offset = (number + 1) * LTO_TID_STRIDE;
+    input.stage_name = "LTRANS " + std::to_string(number);
+  } else {
+    input.stage_name = stage == "wpa" ? "WPA" : "LTO";
+  }
+}
+
+bool ends_with(const char *str, const char *suffix) {
+  size_t length = strlen(str);
+  size_t suffix_length = strlen(suffix);
+  return length >= suffix_length &&
+         !strcmp(str + length - suffix_length, suffix);
+}
+
+// The number of TUs that are compiling at any point in time, which shows how
+// well the build uses the available cores.
+void write_parallelism(MergedWriter &writer, const std::vector<Input> &inputs,
+                       bool print_stats) {
+  std::vector<std::pair<double, int>> changes;
+  double busy_us = 0;
+  for (const Input &input : inputs) {
+    if (input.start_us <= input.end_us) {
+      changes.emplace_back(input.start_us, 1);
+      changes.emplace_back(input.end_us, -1);
+      busy_us += input.end_us - input.start_us;
+    }
+  }
+  if (changes.empty()) {
+    return;
+  }
+  std::sort(changes.begin(), changes.end());
+  int64_t running = 0;
+  for (size_t i = 0; i < changes.size(); ++i) {
+    running += changes[i].second;
+    if (i + 1 == changes.size() || changes[i + 1].first != changes[i].first) {
+      writer.write_build_counter("running_tus", changes[i].first, running);
+    }
+  }
+
+  if (print_stats) {
+    double wall_us = changes.back().first - changes.front().first;
+    fprintf(stderr,
+            "%zu traces, %.3f s wall time, %.3f s compiling, average "
+            "parallelism %.2f\n",
+            inputs.size(), wall_us / 1e6, busy_us / 1e6,
+            wall_us > 0 ? busy_us / wall_us : 0.0);
+  }
+}
+
+void write_thread_name(MergedWriter &writer, int64_t pid, int64_t tid,
+                       const std::string &name) {
+  Event event;
+  event.name = "thread_name";
+  event.ph = "M";
+  event.tid = tid;
+  auto &[key, value] = event.args.emplace_back();
+  key = "name";
+  value.type = JsonValue::STRING;
+  value.text = name;
+  writer.write_event(event, pid);
+}
+
+void print_usage() {
+  fprintf(stderr,
+          "Usage: externis-merge [-o OUTPUT] [--format=json|perfetto] "
+          "[--dedup] [--stats] TRACE...\n"
+          "\n"
+          "Merges externis JSON traces (optionally gzip compressed) into a "
+          "single trace\nwith one process per trace, aligned on their "
+          "beginningOfTime. The lto1 traces\nof a link share one process, "
+          "with a range of threads per LTO stage.\n"
+          "\n"
+          "  -o OUTPUT   Where to write the merged trace. Default: stdout.\n"
+          "  --format    json (default) or perfetto. Defaults to perfetto if "
+          "OUTPUT\n"
+          "              ends with .pftrace.\n"
+          "  --dedup     Perfetto only: intern names once for the whole build "
+          "instead\n"
+          "              of once per trace.\n"
+          "  --stats     Print the wall time and parallelism of the build.\n");
+}
+
+} // namespace
+
+int merge_main(int argc, char **argv) {
+  const char *output_path = nullptr;
+  const char *format = nullptr;
+  bool dedup = false;
+  bool print_stats = false;
+  std::vector<Input> inputs;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "-o") && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (!strncmp(arg, "--format=", 9)) {
+      format = arg + 9;
+    } else if (!strcmp(arg, "--dedup")) {
+      dedup = true;
+    } else if (!strcmp(arg, "--stats")) {
+      print_stats = true;
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      print_usage();
+      return 0;
+    } else if (arg[0] == '-' && arg[1]) {
+      fprintf(stderr, "externis-merge: unknown option %s\n", arg);
+      print_usage();
+      return 2;
+    } else {
+      inputs.emplace_back().path = arg;
+    }
+  }
+  if (inputs.empty()) {
+    print_usage();
+    return 2;
+  }
+  if (!format) {
+    format = output_path && ends_with(output_path, ".pftrace") ? "perfetto"
+                                                               : "json";
+  }
+  if (strcmp(format, "json") && strcmp(format, "perfetto")) {
+    fprintf(stderr, "externis-merge: unknown format %s\n", format);
+    return 2;
+  }
+
+  // Everything is aligned on the earliest trace, so we need all of their
+  // start times before we can write any events.
+  // pid 0 is for the whole build.
+  int64_t beginning_of_time_us = INT64_MAX;
+  int next_pid = 1;
+  std::unordered_map<std::string, int> link_pids;
+  std::vector<std::pair<int, std::string>> link_names;
+  for (Input &input : inputs) {
+    TraceReader reader;
+    if (!reader.open(input.path)) {
+      fprintf(stderr, "externis-merge: %s\n", reader.error().c_str());
+      return 1;
+    }
+    input.beginning_of_time_us = reader.beginning_of_time();
+    beginning_of_time_us =
+        std::min(beginning_of_time_us, input.beginning_of_time_us);
+    read_lto_fields(reader, input);
+    if (!input.lto) {
+      input.pid = next_pid++;
+      continue;
+    }
+    std::string link = string_field(reader, "ltoLink");
+    auto [it, inserted] = link_pids.try_emplace(link, next_pid);
+    if (inserted) {
+      std::string output = string_field(reader, "ltoOutput");
+      link_names.emplace_back(next_pid,
+                              "LTO link " + (output.empty() ? link : output));
+      ++next_pid;
+    }
+    input.pid = it->second;
+  }
+
+  std::FILE *out = stdout;
+  if (output_path && !(out = fopen(output_path, "wb"))) {
+    fprintf(stderr, "externis-merge: couldn't open %s\n", output_path);
+    return 1;
+  }
+  static char out_buffer[1 << 20];
+  setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+  std::unique_ptr<MergedWriter> writer;
+  if (!strcmp(format, "perfetto")) {
+    writer = std::make_unique<PerfettoMergedWriter>(out, dedup);
+  } else {
+    writer = std::make_unique<JsonMergedWriter>(out);
+  }
+  writer->write_header(beginning_of_time_us);
+  for (const auto &[pid, name] : link_names) {
+    writer->write_process_name(pid, name);
+  }
+
+  int status = 0;
+  Event event;
+  std::unordered_map<int, int64_t> next_uids; // By pid.
+  for (Input &input : inputs) {
+    double shift_us = input.beginning_of_time_us - beginning_of_time_us;
+    TraceReader reader;
+    if (!reader.open(input.path)) {
+      fprintf(stderr, "externis-merge: %s\n", reader.error().c_str());
+      status = 1;
+      continue;
+    }
+    int64_t &next_uid = next_uids[input.pid];
+    input.uid_offset = next_uid;
+    writer->start_input(input.pid);
+    if (input.lto) {
+      write_thread_name(*writer, input.pid, input.tid_offset,
+                        input.stage_name);
+    }
+    bool named = input.lto; // The link's process is named up front.
+    while (reader.next(event)) {
+      if (event.ph == "M") {
+        if (input.lto) {
+          if (event.name != "thread_name") {
+            continue;
+          }
+          // Thread names are prefixed with the stage, like "WPA: externis".
+          for (auto &[key, value] : event.args) {
+            if (key == "name" && value.type == JsonValue::STRING) {
+              value.text = input.stage_name + ": " + value.text;
+            }
+          }
+        }
+        named |= event.name == "process_name";
+      } else {
+        event.ts += shift_us;
+        input.start_us = std::min(input.start_us, event.ts);
+        input.end_us = std::max(input.end_us, event.ts + event.dur);
+      }
+      event.tid += input.tid_offset;
+      for (auto &[key, value] : event.args) {
+        if (key == "UID" && value.type == JsonValue::INT) {
+          value.int_value += input.uid_offset;
+          next_uid = std::max(next_uid, value.int_value + 1);
+        }
+      }
+      writer->write_event(event, input.pid);
+    }
+    if (!reader.error().empty()) {
+      fprintf(stderr, "externis-merge: %s\n", reader.error().c_str());
+      status = 1;
+    }
+    // Traces from before the plugin named its process.
+    if (!named) {
+      writer->write_process_name(input.pid, input.path);
+    }
+  }
+  write_parallelism(*writer, inputs, print_stats);
+  writer->write_footer();
+
+  if (fclose(out)) {
+    fprintf(stderr, "externis-merge: couldn't write the merged trace\n");
+    status = 1;
+  }
+  return status;
+}
+
+} // namespace externis::tools
+
+int main(int argc, char **argv) {
+  return externis::tools::merge_main(argc, argv);
+}
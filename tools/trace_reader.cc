@@ -0,0 +1,609 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace_reader.h"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#ifdef EXTERNIS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace externis::tools {
+
+namespace {
+
+// The first bytes of a zstd frame.
+constexpr unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+// A Perfetto trace starts with the tag of its first TracePacket: field 1,
+// length delimited.
+constexpr int PERFETTO_FIRST_BYTE = 0x0a;
+
+bool is_zstd(const char *path) {
+  std::FILE *in = fopen(path, "rb");
+  if (!in) {
+    return false;
+  }
+  unsigned char magic[sizeof(ZSTD_MAGIC)] = {};
+  size_t read = fread(magic, 1, sizeof(magic), in);
+  fclose(in);
+  return read == sizeof(magic) && !memcmp(magic, ZSTD_MAGIC, sizeof(magic));
+}
+
+} // namespace
+
+#ifdef EXTERNIS_HAVE_ZSTD
+struct TraceReader::ZstdInput {
+  ~ZstdInput() {
+    if (in) {
+      fclose(in);
+    }
+    ZSTD_freeDCtx(context);
+  }
+
+  std::FILE *in = nullptr;
+  ZSTD_DCtx *context = ZSTD_createDCtx();
+  std::vector<char> compressed = std::vector<char>(ZSTD_DStreamInSize());
+  ZSTD_inBuffer input{compressed.data(), 0, 0};
+};
+#else
+struct TraceReader::ZstdInput {};
+#endif
+
+const JsonValue *Event::arg(const char *key) const {
+  for (const auto &[name, value] : args) {
+    if (name == key) {
+      return &value;
+    }
+  }
+  return nullptr;
+}
+
+const JsonValue *TraceReader::header_field(const char *key) const {
+  for (const auto &[name, value] : header_fields) {
+    if (name == key) {
+      return &value;
+    }
+  }
+  return nullptr;
+}
+
+TraceReader::TraceReader() = default;
+
+TraceReader::~TraceReader() {
+  if (file) {
+    gzclose(file);
+  }
+}
+
+bool TraceReader::open(const char *trace_path) {
+  path = trace_path;
+  if (is_zstd(trace_path)) {
+#ifdef EXTERNIS_HAVE_ZSTD
+    zstd = std::make_unique<ZstdInput>();
+    zstd->in = fopen(trace_path, "rb");
+    if (!zstd->in) {
+      return fail("couldn't open the file");
+    }
+#else
+    return fail("zstd input is not supported, this build of the tools has "
+                "no libzstd");
+#endif
+  } else {
+    file = gzopen(trace_path, "rb");
+    if (!file) {
+      return fail("couldn't open the file");
+    }
+    gzbuffer(file, BUFFER_SIZE);
+  }
+  if (peek() == PERFETTO_FIRST_BYTE) {
+    skip_whitespace();
+    if (peek() != '{') {
+      return fail("perfetto input is not supported, only JSON traces "
+                  "(format=json) can be read");
+    }
+  }
+  skip_whitespace();
+  if (!expect('{')) {
+    return false;
+  }
+  skip_whitespace();
+  if (peek() == '}') {
+    return fail("no traceEvents");
+  }
+  std::string key;
+  while (true) {
+    skip_whitespace();
+    if (!parse_string(key)) {
+      return false;
+    }
+    skip_whitespace();
+    if (!expect(':')) {
+      return false;
+    }
+    skip_whitespace();
+    if (key == "traceEvents") {
+      if (!expect('[')) {
+        return false;
+      }
+      in_events = true;
+      return true;
+    }
+    JsonValue value;
+    if (!parse_value(value)) {
+      return false;
+    }
+    if (key == "beginningOfTime") {
+      beginning_of_time_us = value.type == JsonValue::INT
+                                 ? value.int_value
+                                 : std::llround(value.double_value);
+    } else if (key == "displayTimeUnit" && value.type == JsonValue::STRING) {
+      time_unit = value.text;
+    } else {
+      header_fields.emplace_back(key, std::move(value));
+    }
+    skip_whitespace();
+    if (get() != ',') {
+      return fail("no traceEvents");
+    }
+  }
+}
+
+bool TraceReader::next(Event &event) {
+  if (!in_events) {
+    return false;
+  }
+  skip_whitespace();
+  if (first_event) {
+    first_event = false;
+  } else if (peek() == ',') {
+    get();
+    skip_whitespace();
+  }
+  if (peek() == ']') {
+    in_events = false;
+    return false;
+  }
+  if (!parse_event(event)) {
+    in_events = false;
+    return false;
+  }
+  return true;
+}
+
+int TraceReader::read_input() {
+  if (file) {
+    return gzread(file, buffer, BUFFER_SIZE);
+  }
+#ifdef EXTERNIS_HAVE_ZSTD
+  ZSTD_outBuffer output{buffer, BUFFER_SIZE, 0};
+  while (!output.pos) {
+    ZSTD_inBuffer &input = zstd->input;
+    if (input.pos == input.size) {
+      input.size = fread(zstd->compressed.data(), 1, zstd->compressed.size(),
+                         zstd->in);
+      input.pos = 0;
+      if (!input.size) {
+        return 0;
+      }
+    }
+    size_t result = ZSTD_decompressStream(zstd->context, &output, &input);
+    if (ZSTD_isError(result)) {
+      fail(ZSTD_getErrorName(result));
+      return -1;
+    }
+  }
+  return output.pos;
+#else
+  return -1;
+#endif
+}
+
+int TraceReader::peek() {
+  if (position == available) {
+    int read = read_input();
+    if (read <= 0) {
+      return EOF;
+    }
+    position = 0;
+    available = read;
+  }
+  return static_cast<unsigned char>(buffer[position]);
+}
+
+int TraceReader::get() {
+  int c = peek();
+  if (c != EOF) {
+    ++position;
+  }
+  return c;
+}
+
+void TraceReader::skip_whitespace() {
+  while (true) {
+    int c = peek();
+    if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+      return;
+    }
+    get();
+  }
+}
+
+bool TraceReader::expect(char c) {
+  if (get() != c) {
+    char message[32];
+    snprintf(message, sizeof(message), "expected '%c'", c);
+    return fail(message);
+  }
+  return true;
+}
+
+namespace {
+
+void append_utf8(std::string &out, uint32_t code_point) {
+  if (code_point < 0x80) {
+    out.push_back(code_point);
+  } else if (code_point < 0x800) {
+    out.push_back(0xc0 | (code_point >> 6));
+    out.push_back(0x80 | (code_point & 0x3f));
+  } else if (code_point < 0x10000) {
+    out.push_back(0xe0 | (code_point >> 12));
+    out.push_back(0x80 | ((code_point >> 6) & 0x3f));
+    out.push_back(0x80 | (code_point & 0x3f));
+  } else {
+    out.push_back(0xf0 | (code_point >> 18));
+    out.push_back(0x80 | ((code_point >> 12) & 0x3f));
+    out.push_back(0x80 | ((code_point >> 6) & 0x3f));
+    out.push_back(0x80 | (code_point & 0x3f));
+  }
+}
+
+void append_json_string(std::string &out, const std::string &str) {
+  out.push_back('"');
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      out.push_back('\\');
+      out.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out += escaped;
+    } else {
+      out.push_back(c);
+    }
+  }
+  out.push_back('"');
+}
+
+} // namespace
+
+bool TraceReader::parse_string(std::string &out) {
+  out.clear();
+  if (!expect('"')) {
+    return false;
+  }
+  while (true) {
+    // Copy the run up to the next quote or escape from the buffer at once.
+    if (peek() == EOF) {
+      return fail("unterminated string");
+    }
+    const char *start = buffer + position;
+    const char *end = buffer + available;
+    const char *special = start;
+    while (special != end && *special != '"' && *special != '\\') {
+      ++special;
+    }
+    out.append(start, special);
+    position += special - start;
+    if (special == end) {
+      continue;
+    }
+    if (get() == '"') {
+      return true;
+    }
+    int escaped = get();
+    switch (escaped) {
+    case '"':
+    case '\\':
+    case '/':
+      out.push_back(escaped);
+      break;
+    case 'b':
+      out.push_back('\b');
+      break;
+    case 'f':
+      out.push_back('\f');
+      break;
+    case 'n':
+      out.push_back('\n');
+      break;
+    case 'r':
+      out.push_back('\r');
+      break;
+    case 't':
+      out.push_back('\t');
+      break;
+    case 'u': {
+      char hex[5] = {};
+      for (int i = 0; i < 4; ++i) {
+        int c = get();
+        if (c == EOF) {
+          return fail("unterminated string");
+        }
+        hex[i] = c;
+      }
+      append_utf8(out, strtoul(hex, nullptr, 16));
+      break;
+    }
+    default:
+      return fail("bad escape sequence");
+    }
+  }
+}
+
+bool TraceReader::parse_number(JsonValue &value) {
+  char digits[64];
+  size_t length = 0;
+  bool integral = true;
+  while (length < sizeof(digits) - 1) {
+    int c = peek();
+    if ((c >= '0' && c <= '9') || c == '-' || c == '+') {
+    } else if (c == '.' || c == 'e' || c == 'E') {
+      integral = false;
+    } else {
+      break;
+    }
+    digits[length++] = get();
+  }
+  digits[length] = '\0';
+  if (!length) {
+    return fail("expected a value");
+  }
+  char *end;
+  if (integral) {
+    value.type = JsonValue::INT;
+    value.int_value = strtoll(digits, &end, 10);
+  } else {
+    value.type = JsonValue::DOUBLE;
+    value.double_value = strtod(digits, &end);
+  }
+  if (*end) {
+    return fail("bad number");
+  }
+  return true;
+}
+
+bool TraceReader::parse_literal(const char *literal) {
+  for (const char *c = literal; *c; ++c) {
+    if (get() != *c) {
+      return fail("expected a value");
+    }
+  }
+  return true;
+}
+
+// Copies nested objects and arrays verbatim, since none of our tools look
+// inside them.
+bool TraceReader::skip_value(std::string *raw) {
+  int depth = 0;
+  std::string str;
+  do {
+    int c = peek();
+    if (c == EOF) {
+      return fail("unexpected end of file");
+    }
+    if (c == '"') {
+      if (!parse_string(str)) {
+        return false;
+      }
+      if (raw) {
+        append_json_string(*raw, str);
+      }
+      continue;
+    }
+    get();
+    if (c == '{' || c == '[') {
+      ++depth;
+    } else if (c == '}' || c == ']') {
+      --depth;
+    }
+    if (raw) {
+      raw->push_back(c);
+    }
+  } while (depth > 0);
+  return true;
+}
+
+bool TraceReader::parse_value(JsonValue &value) {
+  value.text.clear();
+  switch (peek()) {
+  case '"':
+    value.type = JsonValue::STRING;
+    return parse_string(value.text);
+  case '{':
+  case '[':
+    value.type = JsonValue::RAW;
+    return skip_value(&value.text);
+  case 't':
+    value.type = JsonValue::BOOL;
+    value.int_value = 1;
+    return parse_literal("true");
+  case 'f':
+    value.type = JsonValue::BOOL;
+    value.int_value = 0;
+    return parse_literal("false");
+  case 'n':
+    value.type = JsonValue::NUL;
+    return parse_literal("null");
+  default:
+    return parse_number(value);
+  }
+}
+
+bool TraceReader::parse_event(Event &event) {
+  event.name.clear();
+  event.ph.clear();
+  event.cat.clear();
+  event.ts = event.dur = 0;
+  event.has_dur = false;
+  event.pid = event.tid = 0;
+  event.args.clear();
+
+  if (!expect('{')) {
+    return false;
+  }
+  std::string key;
+  JsonValue value;
+  skip_whitespace();
+  if (peek() == '}') {
+    get();
+    return true;
+  }
+  while (true) {
+    skip_whitespace();
+    if (!parse_string(key)) {
+      return false;
+    }
+    skip_whitespace();
+    if (!expect(':')) {
+      return false;
+    }
+    skip_whitespace();
+    if (key == "args" && peek() == '{') {
+      get();
+      skip_whitespace();
+      while (peek() != '}') {
+        auto &[arg_key, arg_value] = event.args.emplace_back();
+        skip_whitespace();
+        if (!parse_string(arg_key)) {
+          return false;
+        }
+        skip_whitespace();
+        if (!expect(':')) {
+          return false;
+        }
+        skip_whitespace();
+        if (!parse_value(arg_value)) {
+          return false;
+        }
+        skip_whitespace();
+        if (peek() == ',') {
+          get();
+          skip_whitespace();
+        }
+      }
+      get();
+    } else {
+      if (!parse_value(value)) {
+        return false;
+      }
+      if (key == "name") {
+        event.name = value.text;
+      } else if (key == "ph") {
+        event.ph = value.text;
+      } else if (key == "cat") {
+        event.cat = value.text;
+      } else if (key == "ts") {
+        event.ts = value.as_double();
+      } else if (key == "dur") {
+        event.dur = value.as_double();
+        event.has_dur = true;
+      } else if (key == "pid") {
+        event.pid = value.int_value;
+      } else if (key == "tid") {
+        event.tid = value.int_value;
+      }
+    }
+    skip_whitespace();
+    int c = get();
+    if (c == '}') {
+      return true;
+    }
+    if (c != ',') {
+      return fail("expected ',' or '}'");
+    }
+  }
+}
+
+bool TraceReader::fail(const char *message) {
+  // The first error is the interesting one, e.g. a decompression error rather
+  // than the unexpected end of file it causes.
+  if (error_message.empty()) {
+    error_message = path + ": " + message;
+  }
+  return false;
+}
+
+void write_json_string(std::FILE *out, const std::string &str) {
+  fputc('"', out);
+  for (char c : str) {
+    switch (c) {
+    case '"':
+      fputs("\\\"", out);
+      break;
+    case '\\':
+      fputs("\\\\", out);
+      break;
+    case '\n':
+      fputs("\\n", out);
+      break;
+    case '\t':
+      fputs("\\t", out);
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        fprintf(out, "\\u%04x", c);
+      } else {
+        fputc(c, out);
+      }
+      break;
+    }
+  }
+  fputc('"', out);
+}
+
+void write_json_value(std::FILE *out, const JsonValue &value) {
+  switch (value.type) {
+  case JsonValue::INT:
+    fprintf(out, "%" PRId64, value.int_value);
+    break;
+  case JsonValue::DOUBLE:
+    fprintf(out, "%.9g", value.double_value);
+    break;
+  case JsonValue::STRING:
+    write_json_string(out, value.text);
+    break;
+  case JsonValue::BOOL:
+    fputs(value.int_value ? "true" : "false", out);
+    break;
+  case JsonValue::NUL:
+    fputs("null", out);
+    break;
+  case JsonValue::RAW:
+    fputs(value.text.c_str(), out);
+    break;
+  }
+}
+
+void write_json_timestamp(std::FILE *out, double us) {
+  fprintf(out, "%.3f", us);
+}
+
+} // namespace externis::tools
@@ -0,0 +1,126 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <zlib.h>
+
+// Reads the JSON traces written by the externis plugin, one event at a time,
+// so tools can process thousands of traces without loading any of them
+// completely. gzip compressed traces are read transparently, and so are zstd
+// compressed ones if the tools are built with libzstd. Perfetto traces can't
+// be read.
+namespace externis::tools {
+
+struct JsonValue {
+  enum Type { INT, DOUBLE, STRING, BOOL, NUL, RAW };
+  Type type = NUL;
+  int64_t int_value = 0;
+  double double_value = 0;
+  // The string for STRING values, the JSON text of nested objects and arrays
+  // for RAW values.
+  std::string text;
+
+  double as_double() const {
+    return type == INT ? static_cast<double>(int_value) : double_value;
+  }
+};
+
+struct Event {
+  std::string name;
+  std::string ph;
+  std::string cat;
+  // In microseconds, like in the file.
+  double ts = 0;
+  double dur = 0;
+  bool has_dur = false;
+  int64_t pid = 0;
+  int64_t tid = 0;
+  std::vector<std::pair<std::string, JsonValue>> args;
+
+  const JsonValue *arg(const char *key) const;
+};
+
+class TraceReader {
+public:
+  TraceReader();
+  TraceReader(const TraceReader &) = delete;
+  TraceReader &operator=(const TraceReader &) = delete;
+  ~TraceReader();
+
+  // Reads everything up to the first event. Returns false and sets error()
+  // if the file can't be opened or isn't a trace.
+  bool open(const char *path);
+  // In microseconds since the epoch. Only known if it comes before
+  // traceEvents in the file, which it does in externis traces.
+  int64_t beginning_of_time() const { return beginning_of_time_us; }
+  const std::string &display_time_unit() const { return time_unit; }
+  // Any other top level member before traceEvents, like the ltoLink,
+  // ltoOutput, ltoStage and ltoPartition of lto1 traces.
+  const JsonValue *header_field(const char *key) const;
+
+  // Returns false after the last event, or on errors.
+  bool next(Event &event);
+  const std::string &error() const { return error_message; }
+
+private:
+  struct ZstdInput;
+
+  // Fills the buffer with the next decompressed bytes.
+  int read_input();
+  int peek();
+  int get();
+  void skip_whitespace();
+  bool expect(char c);
+  bool parse_string(std::string &out);
+  bool parse_value(JsonValue &value);
+  bool parse_number(JsonValue &value);
+  bool parse_literal(const char *literal);
+  bool skip_value(std::string *raw);
+  bool parse_event(Event &event);
+  bool fail(const char *message);
+
+  gzFile file = nullptr;
+  std::unique_ptr<ZstdInput> zstd;
+  std::string path;
+  static constexpr size_t BUFFER_SIZE = 1 << 16;
+  char buffer[BUFFER_SIZE];
+  size_t position = 0;
+  size_t available = 0;
+  bool in_events = false;
+  bool first_event = true;
+  int64_t beginning_of_time_us = 0;
+  std::string time_unit;
+  std::vector<std::pair<std::string, JsonValue>> header_fields;
+  std::string error_message;
+};
+
+// Writes JSON the same way the plugin does.
+void write_json_string(std::FILE *out, const std::string &str);
+void write_json_value(std::FILE *out, const JsonValue &value);
+// Microseconds with nanosecond precision.
+void write_json_timestamp(std::FILE *out, double us);
+
+} // namespace externis::tools
@@ -0,0 +1,235 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// externis-validate: checks that the events of every track in a trace nest
+// properly. Events that overlap without one containing the other, "B" events
+// without an "E" and the other way around, and events that end before they
+// start are errors. Zero-width events are reported as warnings, or as errors
+// with --strict.
+//
+// The trace is read in one streaming pass that matches "B"/"E" pairs. Then the
+// events of each track are sorted and swept with a stack (see intervals.h), so
+// the whole check is O(n log n).
+
+#include "intervals.h"
+#include "trace_reader.h"
+
+#include <cinttypes>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace externis::tools {
+
+namespace {
+
+class Validator : public IntervalBuilder {
+public:
+  Validator(size_t max_messages, bool strict)
+      : max_messages(max_messages), strict(strict) {}
+
+  // Reports the "B" events that never ended and checks the nesting.
+  void finish() {
+    IntervalBuilder::finish();
+    for (auto &[track, intervals] : tracks) {
+      check_nesting(track, intervals);
+    }
+  }
+
+  size_t errors = 0;
+  size_t warnings = 0;
+  size_t events = 0;
+
+private:
+  uint32_t interval_id(const Event &event) override {
+    return name_id(event.name);
+  }
+
+  bool check_interval(Track /*track*/, int64_t start_ns, int64_t end_ns,
+                      uint32_t id) override {
+    ++events;
+    if (end_ns < start_ns) {
+      error("%s ends %" PRId64 "ns before it starts", name(id),
+            start_ns - end_ns);
+      return false;
+    }
+    if (end_ns == start_ns) {
+      if (strict) {
+        error("%s has zero width", name(id));
+      } else {
+        warning("%s has zero width", name(id));
+      }
+    }
+    return true;
+  }
+
+  void reused_uid(const Event &event, int64_t uid, uint32_t other_id) override {
+    error("\"B\" event %s reuses the UID %" PRId64 " of %s", event.name.c_str(),
+          uid, name(other_id));
+  }
+
+  void unmatched_end(const Event &event, const int64_t *uid) override {
+    if (uid) {
+      error("\"E\" event %s (UID %" PRId64 ") has no \"B\" event",
+            event.name.c_str(), *uid);
+    } else {
+      error("\"E\" event %s has no \"B\" event", event.name.c_str());
+    }
+  }
+
+  void end_on_other_thread(const Event &event, int64_t uid) override {
+    error("\"E\" event %s (UID %" PRId64 ") is on another thread than its "
+          "\"B\" event",
+          event.name.c_str(), uid);
+  }
+
+  void unmatched_begin(uint32_t id, const int64_t *uid) override {
+    if (uid) {
+      error("\"B\" event %s (UID %" PRId64 ") has no \"E\" event", name(id),
+            *uid);
+    } else {
+      error("\"B\" event %s has no \"E\" event", name(id));
+    }
+  }
+
+  void check_nesting(Track track, std::vector<Interval> &intervals) {
+    sweep_nesting(intervals, [&](const Interval &interval,
+                                 const Interval *outer) {
+      if (!outer || interval.end_ns <= outer->end_ns) {
+        return true;
+      }
+      error("on pid %" PRId64 " tid %" PRId64 ", %s and %s overlap:\n"
+            "  START1 %" PRId64 "ns +%" PRId64 "ns START2 +%" PRId64
+            "ns END1 +%" PRId64 "ns END2",
+            track.first, track.second, name(outer->id), name(interval.id),
+            outer->start_ns, interval.start_ns - outer->start_ns,
+            outer->end_ns - interval.start_ns, interval.end_ns - outer->end_ns);
+      return false;
+    });
+  }
+
+  uint32_t name_id(const std::string &name) {
+    auto [it, inserted] = name_ids.try_emplace(name, names.size());
+    if (inserted) {
+      names.push_back(name);
+    }
+    return it->second;
+  }
+
+  const char *name(uint32_t id) const { return names[id].c_str(); }
+
+  template <typename... Args> void error(const char *format, Args... args) {
+    report("error", format, args...);
+    ++errors;
+  }
+
+  template <typename... Args> void warning(const char *format, Args... args) {
+    report("warning", format, args...);
+    ++warnings;
+  }
+
+  template <typename... Args>
+  void report(const char *kind, const char *format, Args... args) {
+    if (errors + warnings < max_messages) {
+      fprintf(stderr, "%s: ", kind);
+      fprintf(stderr, format, args...);
+      fputc('\n', stderr);
+    }
+  }
+
+  const size_t max_messages;
+  const bool strict;
+
+  std::vector<std::string> names;
+  std::unordered_map<std::string, uint32_t> name_ids;
+};
+
+void print_usage() {
+  fprintf(stderr,
+          "Usage: externis-validate [--strict] [--max-messages=N] TRACE...\n"
+          "\n"
+          "Checks that the events of each thread in externis JSON traces "
+          "nest properly\nand that every \"B\" event has an \"E\" event.\n"
+          "\n"
+          "  --strict          Zero-width events are errors, not warnings.\n"
+          "  --max-messages=N  Print at most N errors and warnings per "
+          "trace. Default: 20.\n");
+}
+
+} // namespace
+
+int validate_main(int argc, char **argv) {
+  bool strict = false;
+  size_t max_messages = 20;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "--strict")) {
+      strict = true;
+    } else if (!strncmp(arg, "--max-messages=", 15)) {
+      max_messages = strtoull(arg + 15, nullptr, 10);
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      print_usage();
+      return 0;
+    } else if (arg[0] == '-' && arg[1]) {
+      fprintf(stderr, "externis-validate: unknown option %s\n", arg);
+      print_usage();
+      return 2;
+    } else {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty()) {
+    print_usage();
+    return 2;
+  }
+
+  int status = 0;
+  Event event;
+  for (const char *path : paths) {
+    TraceReader reader;
+    if (!reader.open(path)) {
+      fprintf(stderr, "externis-validate: %s\n", reader.error().c_str());
+      status = 1;
+      continue;
+    }
+    Validator validator(max_messages, strict);
+    while (reader.next(event)) {
+      validator.add(event);
+    }
+    if (!reader.error().empty()) {
+      fprintf(stderr, "externis-validate: %s\n", reader.error().c_str());
+      status = 1;
+      continue;
+    }
+    validator.finish();
+    fprintf(stderr, "%s: %zu events, %zu errors, %zu warnings\n", path,
+            validator.events, validator.errors, validator.warnings);
+    if (validator.errors) {
+      status = 1;
+    }
+  }
+  return status;
+}
+
+} // namespace externis::tools
+
+int main(int argc, char **argv) {
+  return externis::tools::validate_main(argc, argv);
+}
@@ -0,0 +1,499 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// externis-wrap: traces a whole compiler invocation, not just cc1. It runs the
+// driver with -wrapper pointing back at itself, so that every program the
+// driver runs (cc1, as, collect2, ...) goes through externis-wrap --child,
+// which records when it was spawned and when it exited. If the externis
+// plugin is loaded, its traces are sent to a temporary directory. At the end,
+// the driver, every subprocess and the plugin's events are written to one
+// trace, on the plugin's time base.
+
+#include "trace_reader.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+namespace externis::tools {
+
+namespace {
+
+constexpr const char *PLUGIN_ARG_PREFIX = "-fplugin-arg-externis-";
+// Plugin arguments that decide where and how the trace is written. We need a
+// JSON trace in our own directory, so these are replaced.
+const char *const OUTPUT_ARGS[] = {"trace=", "trace-dir=", "socket=",
+                                   "format=", "compress="};
+
+// The same clock as the plugin's COMPILATION_START.
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::high_resolution_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t to_ns(const timeval &time) {
+  return time.tv_sec * 1000000000ll + time.tv_usec * 1000ll;
+}
+
+std::string base_name(const char *path) {
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+std::string command_line(char **argv) {
+  std::string command;
+  for (char **arg = argv; *arg; ++arg) {
+    if (arg != argv) {
+      command += ' ';
+    }
+    command += *arg;
+  }
+  // The log has a line per process.
+  std::replace(command.begin(), command.end(), '\n', ' ');
+  return command;
+}
+
+struct Process {
+  int64_t pid = 0;
+  int64_t start_ns = 0;
+  int64_t end_ns = 0;
+  int status = 0;
+  int64_t user_ns = 0;
+  int64_t sys_ns = 0;
+  int64_t max_rss_kb = 0;
+  std::string command;
+};
+
+// Runs argv[0] and waits for it. Returns false if it couldn't be started.
+bool run(char **argv, Process &process) {
+  process.start_ns = now_ns();
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("externis-wrap: fork");
+    return false;
+  }
+  if (!pid) {
+    execvp(argv[0], argv);
+    fprintf(stderr, "externis-wrap: couldn't run %s: %s\n", argv[0],
+            strerror(errno));
+    _exit(127);
+  }
+  // Like the driver itself, only the child should handle the user's ^C.
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  rusage usage{};
+  int status = 0;
+  while (wait4(pid, &status, 0, &usage) == -1 && errno == EINTR) {
+  }
+  process.end_ns = now_ns();
+  process.pid = pid;
+  process.status = status;
+  process.user_ns = to_ns(usage.ru_utime);
+  process.sys_ns = to_ns(usage.ru_stime);
+  process.max_rss_kb = usage.ru_maxrss;
+  process.command = command_line(argv);
+  return true;
+}
+
+// Exits the way the child did, so the driver reports its failures as usual.
+[[noreturn]] void exit_like(int status) {
+  if (WIFSIGNALED(status)) {
+    signal(WTERMSIG(status), SIG_DFL);
+    raise(WTERMSIG(status));
+  }
+  exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+// The driver runs its programs one at a time, but in case some of them run
+// at the same time, lines are appended under a lock, like the plugin's header
+// database:
+//   P <pid> <start ns> <end ns> <status> <user ns> <sys ns> <max rss kB> <cmd>
+void append_to_log(const char *path, const Process &process) {
+  char line[256];
+  snprintf(line, sizeof(line),
+           "P %" PRId64 " %" PRId64 " %" PRId64 " %d %" PRId64 " %" PRId64
+           " %" PRId64 " ",
+           process.pid, process.start_ns, process.end_ns, process.status,
+           process.user_ns, process.sys_ns, process.max_rss_kb);
+  std::string record = line + process.command + '\n';
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "externis-wrap: couldn't open %s\n", path);
+    return;
+  }
+  struct flock lock = {};
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  while (fcntl(fd, F_SETLKW, &lock) == -1 && errno == EINTR) {
+  }
+  size_t written = 0;
+  while (written < record.size()) {
+    ssize_t result =
+        write(fd, record.data() + written, record.size() - written);
+    if (result < 0 && errno != EINTR) {
+      fprintf(stderr, "externis-wrap: couldn't write to %s\n", path);
+      break;
+    }
+    written += std::max<ssize_t>(result, 0);
+  }
+  close(fd);
+}
+
+std::vector<Process> read_log(const std::string &path) {
+  std::vector<Process> processes;
+  std::FILE *file = fopen(path.c_str(), "r");
+  if (!file) {
+    return processes; // The driver didn't run anything.
+  }
+  char *line = nullptr;
+  size_t capacity = 0;
+  ssize_t length;
+  while ((length = getline(&line, &capacity, file)) != -1) {
+    if (length && line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+    Process process;
+    int command_offset = 0;
+    if (sscanf(line,
+               "P %" SCNd64 " %" SCNd64 " %" SCNd64 " %d %" SCNd64
+               " %" SCNd64 " %" SCNd64 " %n",
+               &process.pid, &process.start_ns, &process.end_ns,
+               &process.status, &process.user_ns, &process.sys_ns,
+               &process.max_rss_kb, &command_offset) == 7 &&
+        command_offset) {
+      process.command = line + command_offset;
+      processes.push_back(process);
+    }
+  }
+  free(line);
+  fclose(file);
+  return processes;
+}
+
+class TraceWriter {
+public:
+  TraceWriter(std::FILE *out, int64_t start_ns)
+      : out(out), start_ns(start_ns) {
+    fprintf(out,
+            "{\"displayTimeUnit\":\"ns\",\"beginningOfTime\":%" PRId64
+            ",\"traceEvents\":[",
+            start_ns / 1000);
+  }
+
+  void write_process(const Process &process, bool named) {
+    std::string program =
+        base_name(process.command.substr(0, process.command.find(' ')).c_str());
+    if (!named) {
+      start_event();
+      fprintf(out,
+              "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%" PRId64
+              ",\"args\":{\"name\":",
+              process.pid);
+      write_json_string(out, program);
+      fputs("}}", out);
+    }
+    start_event();
+    fputs("{\"name\":", out);
+    write_json_string(out, program);
+    fputs(",\"cat\":\"TOOLCHAIN\",\"ph\":\"X\",\"ts\":", out);
+    write_json_timestamp(out, (process.start_ns - start_ns) / 1e3);
+    fputs(",\"dur\":", out);
+    write_json_timestamp(out, (process.end_ns - process.start_ns) / 1e3);
+    fprintf(out, ",\"pid\":%" PRId64 ",\"tid\":0,\"args\":{\"command\":",
+            process.pid);
+    write_json_string(out, process.command);
+    fprintf(out,
+            ",\"exit_status\":%d,\"user_ns\":%" PRId64 ",\"sys_ns\":%" PRId64
+            ",\"max_rss_kb\":%" PRId64 "}}",
+            WIFEXITED(process.status) ? WEXITSTATUS(process.status)
+                                      : 128 + WTERMSIG(process.status),
+            process.user_ns, process.sys_ns, process.max_rss_kb);
+  }
+
+  // Copies the events of a plugin trace, moved onto our timeline, and adds
+  // the processes it names to named_pids.
+  bool copy_trace(const std::string &path,
+                  std::unordered_set<int64_t> &named_pids) {
+    TraceReader reader;
+    if (!reader.open(path.c_str())) {
+      fprintf(stderr, "externis-wrap: %s\n", reader.error().c_str());
+      return false;
+    }
+    double shift_us = reader.beginning_of_time() - start_ns / 1e3;
+    Event event;
+    while (reader.next(event)) {
+      if (event.ph == "M" && event.name == "process_name") {
+        named_pids.insert(event.pid);
+      }
+      write_event(event, shift_us);
+    }
+    if (!reader.error().empty()) {
+      fprintf(stderr, "externis-wrap: %s\n", reader.error().c_str());
+      return false;
+    }
+    return true;
+  }
+
+  void finish() { fputs("]}", out); }
+
+private:
+  void write_event(const Event &event, double shift_us) {
+    start_event();
+    fputs("{\"name\":", out);
+    write_json_string(out, event.name);
+    if (!event.cat.empty()) {
+      fputs(",\"cat\":", out);
+      write_json_string(out, event.cat);
+    }
+    fputs(",\"ph\":", out);
+    write_json_string(out, event.ph);
+    if (event.ph != "M") {
+      fputs(",\"ts\":", out);
+      write_json_timestamp(out, event.ts + shift_us);
+    }
+    if (event.has_dur) {
+      fputs(",\"dur\":", out);
+      write_json_timestamp(out, event.dur);
+    }
+    fprintf(out, ",\"pid\":%" PRId64 ",\"tid\":%" PRId64 ",\"args\":{",
+            event.pid, event.tid);
+    bool first_arg = true;
+    for (const auto &[key, value] : event.args) {
+      if (!first_arg) {
+        fputc(',', out);
+      }
+      first_arg = false;
+      write_json_string(out, key);
+      fputc(':', out);
+      write_json_value(out, value);
+    }
+    fputs("}}", out);
+  }
+
+  void start_event() {
+    if (!first_event) {
+      fputc(',', out);
+    }
+    first_event = false;
+  }
+
+  std::FILE *out;
+  const int64_t start_ns;
+  bool first_event = true;
+};
+
+bool is_output_arg(const char *arg) {
+  size_t prefix_length = strlen(PLUGIN_ARG_PREFIX);
+  if (strncmp(arg, PLUGIN_ARG_PREFIX, prefix_length)) {
+    return false;
+  }
+  for (const char *key : OUTPUT_ARGS) {
+    if (!strncmp(arg + prefix_length, key, strlen(key))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string self_path() {
+  std::error_code error;
+  auto path = std::filesystem::read_symlink("/proc/self/exe", error);
+  return error ? "externis-wrap" : path.string();
+}
+
+std::FILE *open_trace(const char *output_path, const char *dir_name) {
+  if (output_path) {
+    std::FILE *file = fopen(output_path, "w");
+    if (!file) {
+      fprintf(stderr, "externis-wrap: couldn't open %s\n", output_path);
+    }
+    return file;
+  }
+  std::string file_template = dir_name;
+  file_template += "/trace_XXXXXX.json";
+  int fd = mkstemps(file_template.data(), strlen(".json"));
+  if (fd == -1) {
+    fprintf(stderr, "externis-wrap: couldn't create a trace in %s\n",
+            dir_name);
+    return nullptr;
+  }
+  return fdopen(fd, "w");
+}
+
+void print_usage() {
+  fprintf(stderr,
+          "Usage: externis-wrap [-o TRACE | --trace-dir=DIR] [--keep] "
+          "COMPILER ARGS...\n"
+          "\n"
+          "Runs the compiler and writes one trace of the whole invocation: "
+          "the driver and\nevery program it runs (cc1, as, collect2, ...), "
+          "with the events of the externis\nplugin if it's loaded.\n"
+          "\n"
+          "  -o TRACE         Where to write the trace.\n"
+          "  --trace-dir=DIR  Write the trace to a new file in DIR. "
+          "Default: /tmp.\n"
+          "  --keep           Keep the temporary directory with the "
+          "plugin's traces.\n");
+}
+
+int child_main(const char *log_path, char **argv) {
+  Process process;
+  if (!run(argv, process)) {
+    return 127;
+  }
+  append_to_log(log_path, process);
+  exit_like(process.status);
+}
+
+} // namespace
+
+int wrap_main(int argc, char **argv) {
+  if (argc >= 3 && !strncmp(argv[1], "--child=", 8)) {
+    return child_main(argv[1] + 8, argv + 2);
+  }
+  const char *output_path = nullptr;
+  const char *dir_name = "/tmp";
+  bool keep = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "-o") && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (!strncmp(arg, "--trace-dir=", 12)) {
+      dir_name = arg + 12;
+    } else if (!strcmp(arg, "--keep")) {
+      keep = true;
+    } else if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+      print_usage();
+      return 0;
+    } else {
+      fprintf(stderr, "externis-wrap: unknown option %s\n", arg);
+      print_usage();
+      return 2;
+    }
+  }
+  if (i == argc) {
+    print_usage();
+    return 2;
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  std::string work_dir = tmp && *tmp ? tmp : "/tmp";
+  work_dir += "/externis-wrap-XXXXXX";
+  if (!mkdtemp(work_dir.data())) {
+    perror("externis-wrap: mkdtemp");
+    return 1;
+  }
+  std::string log_path = work_dir + "/processes.log";
+
+  std::vector<std::string> args;
+  bool plugin = false;
+  for (int arg = i; arg < argc; ++arg) {
+    if (!strcmp(argv[arg], "-wrapper")) {
+      fprintf(stderr, "externis-wrap: can't trace a command that already "
+                      "uses -wrapper\n");
+      return 2;
+    }
+    if (!strncmp(argv[arg], "-fplugin=", 9) && strstr(argv[arg], "externis")) {
+      plugin = true;
+    }
+    if (!is_output_arg(argv[arg])) {
+      args.push_back(argv[arg]);
+    }
+  }
+  if (plugin) {
+    args.push_back(std::string(PLUGIN_ARG_PREFIX) + "trace-dir=" + work_dir);
+    args.push_back(std::string(PLUGIN_ARG_PREFIX) + "format=json");
+  }
+  args.push_back("-wrapper");
+  args.push_back(self_path() + ",--child=" + log_path);
+  std::vector<char *> driver_argv;
+  for (std::string &arg : args) {
+    driver_argv.push_back(arg.data());
+  }
+  driver_argv.push_back(nullptr);
+
+  Process driver;
+  if (!run(driver_argv.data(), driver)) {
+    return 127;
+  }
+  // The trace shows the command as it was given, not with our arguments.
+  driver.command = command_line(argv + i);
+
+  int status = 0;
+  std::FILE *out = open_trace(output_path, dir_name);
+  if (!out) {
+    status = 1;
+  } else {
+    TraceWriter writer(out, driver.start_ns);
+    std::unordered_set<int64_t> named_pids;
+    std::error_code error;
+    for (const auto &entry :
+         std::filesystem::directory_iterator(work_dir, error)) {
+      if (entry.path().extension() == ".json" &&
+          !writer.copy_trace(entry.path().string(), named_pids)) {
+        status = 1;
+      }
+    }
+    std::vector<Process> processes = read_log(log_path);
+    // The driver's CPU time includes the programs it waited for.
+    for (const Process &process : processes) {
+      driver.user_ns -= process.user_ns;
+      driver.sys_ns -= process.sys_ns;
+    }
+    writer.write_process(driver, false);
+    for (const Process &process : processes) {
+      writer.write_process(process, named_pids.contains(process.pid));
+    }
+    writer.finish();
+    if (fclose(out)) {
+      fprintf(stderr, "externis-wrap: couldn't write the trace\n");
+      status = 1;
+    }
+  }
+  if (keep) {
+    fprintf(stderr, "externis-wrap: kept %s\n", work_dir.c_str());
+  } else {
+    std::error_code error;
+    std::filesystem::remove_all(work_dir, error);
+  }
+  if (WIFEXITED(driver.status) && !WEXITSTATUS(driver.status)) {
+    return status;
+  }
+  exit_like(driver.status);
+}
+
+} // namespace externis::tools
+
+int main(int argc, char **argv) {
+  return externis::tools::wrap_main(argc, argv);
+}
@@ -0,0 +1,50 @@
+/**
+ * Copyright (C) 2022 Roy Jacobson
+ * https://github.com/royjacobson/externis
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string_view>
+
+namespace externis {
+
+// The names of the trace files the plugin writes. Shared by the plugin and the
+// tools, which look for them in trace directories.
+enum class OutputFormat { JSON, PERFETTO, SUMMARY };
+
+// By format, and then by compression: none, gzip and zstd.
+inline constexpr const char *TRACE_FILE_EXTENSIONS[3][3] = {
+    {".json", ".json.gz", ".json.zst"},
+    {".pftrace", ".pftrace.gz", ".pftrace.zst"},
+    {".summary.json", ".summary.json.gz", ".summary.json.zst"}};
+
+// Finds the format of a trace file from its name. Returns false for names
+// the plugin doesn't write.
+inline bool trace_file_format(std::string_view name, OutputFormat *format) {
+  // Summaries end like JSON traces, so they're matched first.
+  for (int i = 2; i >= 0; --i) {
+    for (const char *extension : TRACE_FILE_EXTENSIONS[i]) {
+      if (name.ends_with(extension)) {
+        *format = static_cast<OutputFormat>(i);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+} // namespace externis
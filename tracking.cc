@@ -19,7 +19,7 @@
 
 #include "externis.h"
 
-#include <stack>
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -31,34 +31,225 @@ namespace externis {
 time_point_t COMPILATION_START;
 
 namespace {
-map_t<std::string, int64_t> preprocess_start;
-map_t<std::string, int64_t> preprocess_end;
-std::stack<std::string> preprocessing_stack;
-const char *CIRCULAR_POISON_VALUE = "CIRCULAR_POISON_VALUE_95d6021c";
+// Every time a file is entered is a separate inclusion, nested in the
+// inclusion of the file that included it.
+constexpr int NO_PARENT = -1;
+struct Inclusion {
+  StringId file;
+  // Inclusions are numbered in the order they start.
+  int index;
+  int parent;
+  TimeSpan ts;
+  // Time spent in the inclusions nested directly in this one.
+  TimeStamp children_ns;
+  // How many times the file was entered before. GCC doesn't enter files with
+  // include guards or #pragma once again, so these are files that are lexed
+  // more than once.
+  int repeat;
+};
+// Only the open inclusions have to stay in memory. Closed ones wait in
+// finished_inclusions until they're written.
+std::vector<Inclusion> open_inclusions;
+std::vector<Inclusion> finished_inclusions;
+int inclusion_count = 0;
+map_t<StringId, int> inclusions_per_file;
+// Summed over all the inclusions of each header.
+struct HeaderTotal {
+  StringId file;
+  TimeStamp self_ns = 0;
+  TimeStamp inclusive_ns = 0;
+  int64_t inclusions = 0;
+};
+map_t<StringId, HeaderTotal> header_totals;
+int64_t repeated_inclusions = 0;
+TimeStamp repeated_inclusions_ns = 0;
+
+map_t<const char *, Aggregate> pass_aggregates; // By pass name.
+map_t<StringId, Aggregate> header_aggregates;
+map_t<void *, Aggregate> scope_aggregates;
+map_t<void *, Aggregate> template_aggregates; // By primary template.
+
+// Instantiation time per primary template, for the timeline's template track.
+// The summary format only keeps template_aggregates instead.
+struct TemplateTotal {
+  EventCategory category;
+  Aggregate aggregate;
+  // Distinct classes of class templates, or functions of function templates.
+  int64_t specializations = 0;
+};
+map_t<void *, TemplateTotal> template_totals;
+set_t<void *> seen_specializations;
 
 TimeStamp last_function_parsed_ts;
+PerfCounts last_function_parsed_counts;
+
+PerfCounts read_counters_if_enabled() {
+  return perf_counters_enabled() ? read_perf_counters() : PerfCounts{};
+}
 
 struct OptPassEvent {
   const opt_pass *pass;
+  // The function a per-function pass runs on, nullptr for IPA passes.
+  void *function;
   TimeSpan ts;
+  PerfCounts counts;
 };
 OptPassEvent last_pass;
-std::vector<OptPassEvent> pass_events;
 
-map_t<std::string, std::string> file_to_include_directory;
-map_t<std::string, std::string> normalized_files_map;
-set_t<std::string> normalized_files;
-set_t<std::string> conflicted_files;
+// Finished events waiting to be written, stored column-wise so writing them
+// is a loop over a few flat arrays. What the two argument slots hold depends
+// on the category:
+//   passes: the static pass number and the function name (or NO_STRING).
+//   functions: the file name.
+//   instantiations: the file name and the primary template's name.
+//   scopes: nothing.
+// With hardware counters, passes and functions also keep the counter deltas.
+class EventStore {
+public:
+  void add(StringId name, EventCategory category, TimeSpan ts,
+           int64_t arg0 = 0, int64_t arg1 = 0,
+           const PerfCounts &counts = {}) {
+    names.push_back(name);
+    categories.push_back(category);
+    starts.push_back(ts.start);
+    ends.push_back(ts.end);
+    arg0s.push_back(arg0);
+    arg1s.push_back(arg1);
+    if (perf_counters_enabled()) {
+      perf_counts.push_back(counts);
+    }
+  }
+
+  size_t size() const { return names.size(); }
+
+  void clear() {
+    names.clear();
+    categories.clear();
+    starts.clear();
+    ends.clear();
+    arg0s.clear();
+    arg1s.clear();
+    perf_counts.clear();
+  }
+
+  std::vector<StringId> names;
+  std::vector<uint8_t> categories;
+  std::vector<TimeStamp> starts;
+  std::vector<TimeStamp> ends;
+  std::vector<int64_t> arg0s;
+  std::vector<int64_t> arg1s;
+  std::vector<PerfCounts> perf_counts;
+};
+EventStore finished_events;
+
+// Once a buffer holds max_buffered_events() events, it's flushed to the trace
+// right away, so the buffers don't grow with the size of the TU. The interned
+// strings and the per-header and per-function totals still grow with the
+// number of distinct headers and functions.
+int64_t early_flushes = 0;
+int64_t spilled_events = 0;
+
+bool buffer_is_full(size_t size) {
+  size_t limit = max_buffered_events();
+  return limit && size >= limit;
+}
+
+// Stored as deltas, so they can be written like any other argument.
+PerfCounts difference(const PerfCounts &start, const PerfCounts &end) {
+  PerfCounts delta;
+  for (int i = 0; i < PERF_COUNTER_COUNT; ++i) {
+    delta.values[i] = end.values[i] - start.values[i];
+  }
+  return delta;
+}
+
+void add_perf_counts(EventArgs &args, size_t event) {
+  if (perf_counters_enabled()) {
+    add_perf_counter_args(args, finished_events.perf_counts[event]);
+  }
+}
+
+// Functions that passes ran on, by decl. Printing a function's name is
+// expensive, so it's only done once one of its events is kept.
+struct OptimizedFunction {
+  TimeStamp optimize_ns = 0;
+  StringId name = NO_STRING;
+};
+map_t<void *, uint32_t> optimized_function_ids;
+std::vector<OptimizedFunction> optimized_functions;
+
+uint32_t optimized_function_id(void *function) {
+  auto [it, inserted] =
+      optimized_function_ids.try_emplace(function, optimized_functions.size());
+  if (inserted) {
+    optimized_functions.emplace_back();
+  }
+  return it->second;
+}
+
+StringId optimized_function_name(void *function) {
+  StringId &name = optimized_functions[optimized_function_id(function)].name;
+  if (name == NO_STRING) {
+    name = intern(function_name(function));
+  }
+  return name;
+}
+
+// Consecutive passes on the same function are grouped under a synthetic
+// "optimize <function>" event.
+struct OptimizeEvent {
+  uint32_t function; // Index into optimized_functions.
+  StringId name;
+  TimeSpan ts;
+};
+// The function current_optimization runs on, nullptr between functions.
+void *optimized_function = nullptr;
+OptimizeEvent current_optimization;
+std::vector<OptimizeEvent> optimize_events;
+// Optimize events carry the total time spent optimizing their function, which
+// is only known at the end. So instead of writing them early, full buffers are
+// spilled to a temporary file and read back at the end.
+FILE *optimize_spill_file = nullptr;
+bool spill_file_failed = false;
+
+void spill_optimize_events() {
+  if (!optimize_spill_file && !spill_file_failed) {
+    optimize_spill_file = tmpfile();
+    if (!optimize_spill_file) {
+      fprintf(stderr, "Externis warning: Couldn't create a spill file, "
+                      "optimize events are kept in memory\n");
+      spill_file_failed = true;
+    }
+  }
+  if (!optimize_spill_file) {
+    return;
+  }
+  // The events hold interned ids and function indices, so they can only be
+  // read back by this process - which is all we need.
+  if (fwrite(optimize_events.data(), sizeof(OptimizeEvent),
+             optimize_events.size(),
+             optimize_spill_file) != optimize_events.size()) {
+    fprintf(stderr, "Externis Error! Couldn't write to the spill file\n");
+  }
+  spilled_events += optimize_events.size();
+  optimize_events.clear();
+}
+
+map_t<StringId, StringId> file_to_include_directory;
+map_t<StringId, StringId> normalized_files_map;
+set_t<StringId> normalized_files;
+set_t<StringId> conflicted_files;
 
 void register_include_location(const char *file_name, const char *dir_name) {
-  if (!file_to_include_directory.contains(file_name)) {
-    std::string file_std = file_name;
-    file_to_include_directory[file_name] = dir_name;
-    auto &folder_std = file_to_include_directory[file_std];
+  StringId file_id = intern(file_name);
+  if (!file_to_include_directory.contains(file_id)) {
+    file_to_include_directory[file_id] = intern(dir_name);
+    std::string_view file_std = file_name;
+    std::string_view folder_std = dir_name;
     if (file_std.starts_with(folder_std)) {
       // +1 for path separator.
-      auto normalized_file = file_std.substr(folder_std.size() + 1);
-      normalized_files_map[file_std] = normalized_file;
+      auto normalized_file = intern(file_std.substr(folder_std.size() + 1));
+      normalized_files_map[file_id] = normalized_file;
       if (normalized_files.contains(normalized_file)) {
         conflicted_files.insert(normalized_file);
       } else {
@@ -71,12 +262,46 @@ void register_include_location(const char *file_name, const char *dir_name) {
   }
 }
 
-const char *normalized_file_name(const char *file_name) {
-  if (normalized_files_map.contains(file_name) and
-      !conflicted_files.contains(normalized_files_map[file_name])) {
-    return normalized_files_map[file_name].data();
+// realpath() costs a few syscalls, so we resolve every include directory
+// once and skip files whose include location is already registered.
+constexpr StringId UNRESOLVED = NO_STRING;
+map_t<const cpp_dir *, StringId> real_dir_names;
+set_t<StringId> registered_files;
+int64_t realpath_calls = 0;
+int64_t realpath_calls_saved = 0;
+
+StringId resolve_path(const char *path) {
+  ++realpath_calls;
+  auto real_path = realpath(path, nullptr);
+  if (!real_path) {
+    return UNRESOLVED;
+  }
+  StringId id = intern(real_path);
+  free(real_path);
+  return id;
+}
+
+StringId real_dir_name(const cpp_dir *dir) {
+  auto [it, inserted] = real_dir_names.try_emplace(dir, UNRESOLVED);
+  if (inserted) {
+    it->second = resolve_path(dir->name);
+    if (it->second == UNRESOLVED && strcmp(dir->name, "")) {
+      fprintf(stderr, "Externis error! Couldn't call realpath(\"%s\")\n",
+              dir->name);
+    }
+  } else {
+    ++realpath_calls_saved;
+  }
+  return it->second;
+}
+
+const char *normalized_file_name(StringId file_name) {
+  auto normalized = normalized_files_map.find(file_name);
+  if (normalized != normalized_files_map.end() and
+      !conflicted_files.contains(normalized->second)) {
+    return interned_string(normalized->second);
   } else {
-    return file_name;
+    return interned_string(file_name);
   }
 }
 
@@ -94,25 +319,238 @@ EventCategory pass_type(opt_pass_type type) {
   return UNKNOWN;
 }
 
-struct ScopeEvent {
-  std::string name;
+void finish_pass(const OptPassEvent &event, const PerfCounts &end_counts) {
+  if (summary_mode()) {
+    // Clones of a pass share their name.
+    pass_aggregates[event.pass->name].add(event.ts.end - event.ts.start);
+    return;
+  }
+  EventCategory category = pass_type(event.pass->type);
+  if (should_keep_event(category, event.ts)) {
+    finished_events.add(
+        intern(event.pass->name), category, event.ts,
+        event.pass->static_pass_number,
+        event.function ? optimized_function_name(event.function) : NO_STRING,
+        difference(event.counts, end_counts));
+  }
+}
+
+void finish_optimization(TimeStamp now) {
+  if (!optimized_function) {
+    return;
+  }
+  current_optimization.ts.end = now;
+  optimized_functions[current_optimization.function].optimize_ns +=
+      current_optimization.ts.end - current_optimization.ts.start;
+  if (should_keep_event(EventCategory::OPTIMIZE, current_optimization.ts)) {
+    std::string name = "optimize ";
+    name += interned_string(optimized_function_name(optimized_function));
+    current_optimization.name = intern(name);
+    optimize_events.push_back(current_optimization);
+    if (buffer_is_full(optimize_events.size())) {
+      spill_optimize_events();
+    }
+  }
+  optimized_function = nullptr;
+}
+
+// The scope of the last parsed function. Consecutive functions in the same
+// scope extend it, and it's only named once it ends and survived filtering.
+struct OpenScope {
+  void *scope;
   EventCategory type;
   TimeSpan ts;
 };
-std::vector<ScopeEvent> scope_events;
+OpenScope open_scope;
 
-struct FunctionEvent {
-  std::string name;
-  const char *file_name;
-  TimeSpan ts;
-};
+void close_open_scope() {
+  if (open_scope.scope && should_keep_event(open_scope.type, open_scope.ts)) {
+    finished_events.add(intern(scope_name(open_scope.scope)), open_scope.type,
+                        open_scope.ts);
+  }
+  open_scope.scope = nullptr;
+}
 
-std::vector<FunctionEvent> function_events;
+void flush_finished_events() {
+  for (size_t i = 0; i < finished_events.size(); ++i) {
+    auto category = static_cast<EventCategory>(finished_events.categories[i]);
+    TraceEvent event{interned_string(finished_events.names[i]),
+                     category,
+                     {finished_events.starts[i], finished_events.ends[i]}};
+    int64_t arg0 = finished_events.arg0s[i];
+    int64_t arg1 = finished_events.arg1s[i];
+    switch (category) {
+    case EventCategory::FUNCTION:
+      event.args.add_string("file", normalized_file_name(arg0));
+      add_perf_counts(event.args, i);
+      break;
+    case EventCategory::INSTANTIATE_FUNCTION:
+    case EventCategory::INSTANTIATE_MEMBER:
+      event.args.add_string("file", normalized_file_name(arg0));
+      event.args.add_string("template", interned_string(arg1));
+      add_perf_counts(event.args, i);
+      break;
+    case EventCategory::GIMPLE_PASS:
+    case EventCategory::RTL_PASS:
+    case EventCategory::SIMPLE_IPA_PASS:
+    case EventCategory::IPA_PASS:
+      event.args.add_int("static_pass_number", arg0);
+      if (arg1 != NO_STRING) {
+        event.args.add_string("function", interned_string(arg1));
+      }
+      add_perf_counts(event.args, i);
+      break;
+    default:
+      break;
+    }
+    add_event(event);
+  }
+  finished_events.clear();
+}
+
+// When a writer thread serializes events in the background, finished events
+// are handed to it in batches while GCC keeps working, instead of all at
+// the end of the compilation.
+constexpr size_t STREAMING_BATCH_SIZE = 256;
+
+void stream_finished_events() {
+  if (events_are_streamed() &&
+      finished_events.size() >= STREAMING_BATCH_SIZE) {
+    flush_finished_events();
+  } else if (buffer_is_full(finished_events.size())) {
+    ++early_flushes;
+    flush_finished_events();
+  }
+}
+
+void write_optimize_event(const OptimizeEvent &optimization) {
+  TraceEvent event{interned_string(optimization.name), EventCategory::OPTIMIZE,
+                   optimization.ts};
+  event.args.add_int("function_total_ns",
+                     optimized_functions[optimization.function].optimize_ns);
+  add_event(event);
+}
+
+void write_optimize_events() {
+  if (optimize_spill_file) {
+    rewind(optimize_spill_file);
+    std::vector<OptimizeEvent> chunk(max_buffered_events());
+    size_t count;
+    while ((count = fread(chunk.data(), sizeof(OptimizeEvent), chunk.size(),
+                          optimize_spill_file))) {
+      for (size_t i = 0; i < count; ++i) {
+        write_optimize_event(chunk[i]);
+      }
+    }
+    fclose(optimize_spill_file);
+    optimize_spill_file = nullptr;
+  }
+  for (const auto &optimization : optimize_events) {
+    write_optimize_event(optimization);
+  }
+  optimize_events.clear();
+}
+
+TimeStamp self_time(const Inclusion &inclusion) {
+  return inclusion.ts.end - inclusion.ts.start - inclusion.children_ns;
+}
+
+void flush_finished_inclusions() {
+  for (const auto &inclusion : finished_inclusions) {
+    TraceEvent event{normalized_file_name(inclusion.file),
+                     EventCategory::PREPROCESS, inclusion.ts};
+    event.args.add_int("inclusion", inclusion.index);
+    event.args.add_int("self_ns", self_time(inclusion));
+    if (inclusion.parent != NO_PARENT) {
+      event.args.add_int("parent", inclusion.parent);
+    }
+    if (inclusion.repeat) {
+      event.args.add_int("repeat", inclusion.repeat);
+    }
+    add_event(event);
+  }
+  finished_inclusions.clear();
+}
+
+// The headers with the most self time in the TU, summed over all of their
+// inclusions, are laid out back to back on their own track.
+constexpr size_t HEADER_SUMMARY_SIZE = 20;
+
+void write_header_summary() {
+  std::vector<HeaderTotal> totals;
+  totals.reserve(header_totals.size());
+  for (const auto &[file, total] : header_totals) {
+    totals.push_back(total);
+  }
+  size_t count = std::min(HEADER_SUMMARY_SIZE, totals.size());
+  std::partial_sort(totals.begin(), totals.begin() + count, totals.end(),
+                    [](const HeaderTotal &lhs, const HeaderTotal &rhs) {
+                      return lhs.self_ns > rhs.self_ns;
+                    });
+
+  set_track_name(HEADERS_TID, "headers by self time");
+  TimeStamp ts = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const auto &total = totals[i];
+    TraceEvent event{normalized_file_name(total.file),
+                     EventCategory::HEADER,
+                     {ts + 1, ts + total.self_ns},
+                     {},
+                     HEADERS_TID};
+    event.args.add_int("rank", i + 1);
+    event.args.add_int("self_ns", total.self_ns);
+    event.args.add_int("inclusive_ns", total.inclusive_ns);
+    event.args.add_int("inclusions", total.inclusions);
+    add_event(event);
+    ts += total.self_ns;
+  }
+}
+
+// Like the headers, the templates we spent the most time instantiating are
+// laid out back to back on their own track.
+constexpr size_t TEMPLATE_SUMMARY_SIZE = 20;
+
+void write_template_summary() {
+  std::vector<std::pair<void *, const TemplateTotal *>> totals;
+  totals.reserve(template_totals.size());
+  for (const auto &[primary_template, total] : template_totals) {
+    totals.emplace_back(primary_template, &total);
+  }
+  size_t count = std::min(TEMPLATE_SUMMARY_SIZE, totals.size());
+  std::partial_sort(totals.begin(), totals.begin() + count, totals.end(),
+                    [](const auto &lhs, const auto &rhs) {
+                      return lhs.second->aggregate.total_ns >
+                             rhs.second->aggregate.total_ns;
+                    });
+
+  set_track_name(TEMPLATES_TID, "templates by instantiation time");
+  TimeStamp ts = 0;
+  for (size_t i = 0; i < count; ++i) {
+    const auto &[primary_template, total] = totals[i];
+    const Aggregate &aggregate = total->aggregate;
+    TraceEvent event{interned_string(intern(template_name(primary_template))),
+                     EventCategory::TEMPLATE,
+                     {ts + 1, ts + aggregate.total_ns},
+                     {},
+                     TEMPLATES_TID};
+    event.args.add_int("rank", i + 1);
+    event.args.add_string("kind",
+                          total->category == EventCategory::INSTANTIATE_MEMBER
+                              ? "class"
+                              : "function");
+    event.args.add_int("total_ns", aggregate.total_ns);
+    event.args.add_int("max_ns", aggregate.max_ns);
+    event.args.add_int("instantiations", aggregate.count);
+    event.args.add_int("specializations", total->specializations);
+    add_event(event);
+    ts += aggregate.total_ns;
+  }
+}
 
 } // namespace
 
 void finish_preprocessing_stage() {
-  while (!preprocessing_stack.empty()) {
+  while (!open_inclusions.empty()) {
     end_preprocess_file();
     last_function_parsed_ts = ns_from_start();
   }
@@ -123,124 +561,220 @@ void start_preprocess_file(const char *file_name, cpp_reader *pfile) {
   if (!file_name || !strcmp(file_name, "<command-line>")) {
     return;
   }
-  if (preprocess_start.contains(file_name) &&
-      !preprocess_end.contains(file_name)) {
-    // This is an edge case - this means that file_name is somewhere down the
-    // stack and we have a circular include. Big fun!
-    // Because we don't want to add the inner include, we replace file_name
-    // with a poison value and set pfile to nullptr.
-    file_name = CIRCULAR_POISON_VALUE;
-    pfile = nullptr;
-  }
-
-  if (!preprocess_start.contains(file_name)) {
-    preprocess_start[file_name] = now;
-  }
-
-  preprocessing_stack.push(file_name);
+  StringId file_id = intern(file_name);
+  int parent =
+      open_inclusions.empty() ? NO_PARENT : open_inclusions.back().index;
+  int repeat = inclusions_per_file[file_id]++;
+  open_inclusions.push_back(
+      Inclusion{file_id, inclusion_count++, parent, {now, now}, 0, repeat});
   // This finds out which folder the file was included from.
-  if (pfile) {
+  if (pfile && registered_files.insert(file_id).second) {
     auto cpp_buffer = cpp_get_buffer(pfile);
     auto cpp_file = cpp_get_file(cpp_buffer);
     auto dir = cpp_get_dir(cpp_file);
-    auto real_dir_name = realpath(dir->name, nullptr);
-    auto real_file_name = realpath(file_name, nullptr);
-    if (real_dir_name && real_file_name) {
-      register_include_location(real_file_name, real_dir_name);
-    } else {
-      if (strcmp(dir->name, "")) {
-        fprintf(stderr, "Externis error! Couldn't call realpath(\"%s\")\n",
-                dir->name);
+    StringId real_dir = real_dir_name(dir);
+    if (real_dir != UNRESOLVED) {
+      StringId real_file = resolve_path(file_name);
+      if (real_file != UNRESOLVED) {
+        register_include_location(interned_string(real_file),
+                                  interned_string(real_dir));
       }
     }
-    if (real_dir_name) {
-      free(real_dir_name);
-    }
-    if (real_file_name) {
-      free(real_file_name);
-    }
+  } else if (pfile) {
+    // Both the directory and the file would've been resolved again.
+    realpath_calls_saved += 2;
   }
 }
 
+void add_preprocessing_stats(EventArgs &args) {
+  args.add_int("realpath_calls", realpath_calls);
+  args.add_int("realpath_calls_saved", realpath_calls_saved);
+  args.add_int("repeated_inclusions", repeated_inclusions);
+  args.add_int("repeated_inclusions_ns", repeated_inclusions_ns);
+}
+
+void add_buffering_stats(EventArgs &args) {
+  args.add_int("early_flushes", early_flushes);
+  args.add_int("spilled_events", spilled_events);
+}
+
 void end_preprocess_file() {
   auto now = ns_from_start();
-  if (!preprocess_end.contains(preprocessing_stack.top())) {
-    preprocess_end[preprocessing_stack.top()] = now;
+  if (open_inclusions.empty()) {
+    return;
+  }
+  Inclusion inclusion = open_inclusions.back();
+  inclusion.ts.end = now;
+  open_inclusions.pop_back();
+  TimeStamp length = inclusion.ts.end - inclusion.ts.start;
+  if (inclusion.parent != NO_PARENT) {
+    open_inclusions.back().children_ns += length;
+    auto &total = header_totals[inclusion.file];
+    total.file = inclusion.file;
+    total.self_ns += length - inclusion.children_ns;
+    total.inclusive_ns += length;
+    ++total.inclusions;
+  }
+  if (inclusion.repeat) {
+    ++repeated_inclusions;
+    repeated_inclusions_ns += length;
+  }
+  if (summary_mode()) {
+    if (inclusion.parent != NO_PARENT) {
+      header_aggregates[inclusion.file].add(length - inclusion.children_ns);
+    }
+  } else {
+    finished_inclusions.push_back(inclusion);
+    if (buffer_is_full(finished_inclusions.size())) {
+      ++early_flushes;
+      flush_finished_inclusions();
+    }
   }
-  preprocessing_stack.pop();
   last_function_parsed_ts = now + 3;
+  last_function_parsed_counts = read_counters_if_enabled();
 }
 
 void write_preprocessing_events() {
   finish_preprocessing_stage(); // Should've already happened, but in any case.
-  for (const auto &[file, start] : preprocess_start) {
-    if (file == CIRCULAR_POISON_VALUE) {
-      continue;
-    }
-    int64_t end = preprocess_end.at(file);
-    add_event(TraceEvent{normalized_file_name(file.data()),
-                         EventCategory::PREPROCESS,
-                         {start, end},
-                         std::nullopt});
+  flush_finished_inclusions();
+  if (!summary_mode()) {
+    write_header_summary();
   }
 }
 
+void write_header_db() {
+  if (!header_db_enabled()) {
+    return;
+  }
+  finish_preprocessing_stage();
+  std::vector<HeaderCost> costs;
+  costs.reserve(header_totals.size());
+  for (const auto &[file, total] : header_totals) {
+    costs.push_back(HeaderCost{normalized_file_name(file), total.self_ns,
+                               total.inclusive_ns, total.inclusions});
+  }
+  // The same TU can be compiled from different directories, so it's
+  // identified by its real path.
+  StringId tu = resolve_path(main_input_filename);
+  append_to_header_db(tu != UNRESOLVED ? interned_string(tu)
+                                       : main_input_filename,
+                      costs);
+}
+
 void start_opt_pass(const opt_pass *pass) {
   auto now = ns_from_start();
-  last_pass.ts.end = now;
+  // Passes are nested in their "optimize" event, so they start and end a bit
+  // inside it.
+  PerfCounts counts = read_counters_if_enabled();
   if (last_pass.pass) {
-    pass_events.emplace_back(last_pass);
+    last_pass.ts.end = now - 1;
+    finish_pass(last_pass, counts);
   }
-  last_pass.pass = pass;
-  last_pass.ts.start = now + 1;
-}
-
-void write_opt_pass_events() {
-  for (const auto &event : pass_events) {
-    map_t<std::string, std::string> args;
-    args["static_pass_number"] = std::to_string(event.pass->static_pass_number);
-    add_event(TraceEvent{event.pass->name, pass_type(event.pass->type),
-                         event.ts, std::move(args)});
+  void *function = pass ? pass_function(pass) : nullptr;
+  if (!summary_mode() && function != optimized_function) {
+    finish_optimization(now);
+    if (function) {
+      optimized_function = function;
+      current_optimization = OptimizeEvent{optimized_function_id(function),
+                                           NO_STRING, {now + 1, 0}};
+    }
   }
+  last_pass = OptPassEvent{pass, function, {now + 2, 0}, counts};
+  stream_finished_events();
 }
 
 void end_parse_function(FinishedFunction info) {
-  static bool did_last_function_have_scope = false;
-  TimeStamp now = ns_from_start();
-
   // Because of UI bugs we can't have different events starting and ending
   // at the same time - so we adjust some of the events by a few nanoseconds.
 
-  TimeSpan ts{last_function_parsed_ts + 3, now};
-  last_function_parsed_ts = now;
-  function_events.emplace_back(info.name, info.file_name, ts);
+  TimeSpan ts{last_function_parsed_ts + 3, info.ts};
+  last_function_parsed_ts = info.ts;
+  PerfCounts start_counts = last_function_parsed_counts;
+  last_function_parsed_counts = read_counters_if_enabled();
 
-  if (info.scope_name) {
-    if (!scope_events.empty() && did_last_function_have_scope &&
-        scope_events.back().name == info.scope_name) {
-      scope_events.back().ts.end = ts.end + 1;
-    } else {
-      scope_events.emplace_back(info.scope_name, info.scope_type,
-                                TimeSpan{ts.start - 1, ts.end + 1});
+  // Instantiations are parsed at the end of the TU or when they're first
+  // used, so the time since the last parsed function is their instantiation
+  // time.
+  EventCategory category = EventCategory::FUNCTION;
+  void *specialization = nullptr;
+  void *primary_template =
+      function_template(info.decl, &category, &specialization);
+  if (summary_mode()) {
+    if (primary_template) {
+      template_aggregates[primary_template].add(ts.end - ts.start);
     }
-    did_last_function_have_scope = true;
+    EventCategory scope_type = EventCategory::UNKNOWN;
+    if (void *scope = function_scope(info.decl, &scope_type)) {
+      scope_aggregates[scope].add(ts.end - ts.start);
+    }
+    return;
+  }
+  if (primary_template) {
+    auto [it, inserted] = template_totals.try_emplace(primary_template);
+    TemplateTotal &total = it->second;
+    total.category = category;
+    total.aggregate.add(ts.end - ts.start);
+    total.specializations += seen_specializations.insert(specialization).second;
+  }
+  if (should_keep_event(category, ts)) {
+    finished_events.add(
+        intern(function_name(info.decl)), category, ts,
+        intern(function_file_name(info.decl)),
+        primary_template ? intern(template_name(primary_template)) : NO_STRING,
+        difference(start_counts, last_function_parsed_counts));
+  }
+
+  EventCategory scope_type = EventCategory::UNKNOWN;
+  void *scope = function_scope(info.decl, &scope_type);
+  if (scope && scope == open_scope.scope) {
+    open_scope.ts.end = ts.end + 1;
   } else {
-    did_last_function_have_scope = false;
+    close_open_scope();
+    if (scope) {
+      open_scope = OpenScope{scope, scope_type, {ts.start - 1, ts.end + 1}};
+    }
   }
+  stream_finished_events();
 }
 
-void write_all_scopes() {
-  for (const auto &[name, type, ts] : scope_events) {
-    add_event(TraceEvent{name.data(), type, ts, std::nullopt});
+void write_summary_tables() {
+  std::vector<SummaryRow> rows;
+  auto write_table = [&rows](const char *table) {
+    std::sort(rows.begin(), rows.end(),
+              [](const SummaryRow &lhs, const SummaryRow &rhs) {
+                return lhs.aggregate->total_ns > rhs.aggregate->total_ns;
+              });
+    write_summary_table(table, rows);
+    rows.clear();
+  };
+  for (const auto &[name, aggregate] : pass_aggregates) {
+    rows.push_back(SummaryRow{name, &aggregate});
+  }
+  write_table("passes");
+  for (const auto &[file, aggregate] : header_aggregates) {
+    rows.push_back(SummaryRow{normalized_file_name(file), &aggregate});
+  }
+  write_table("headers");
+  for (const auto &[scope, aggregate] : scope_aggregates) {
+    rows.push_back(SummaryRow{interned_string(intern(scope_name(scope))),
+                              &aggregate});
+  }
+  write_table("scopes");
+  for (const auto &[primary_template, aggregate] : template_aggregates) {
+    rows.push_back(
+        SummaryRow{interned_string(intern(template_name(primary_template))),
+                   &aggregate});
   }
+  write_table("templates");
 }
 
-void write_all_functions() {
-  for (const auto &[name, file_name, ts] : function_events) {
-    map_t<std::string, std::string> args;
-    args["file"] = normalized_file_name(file_name);
-    add_event(
-        TraceEvent{name.data(), EventCategory::FUNCTION, ts, std::move(args)});
+void write_finished_events() {
+  start_opt_pass(nullptr); // Finishes the last pass.
+  close_open_scope();
+  flush_finished_events();
+  if (!summary_mode()) {
+    write_template_summary();
   }
+  write_optimize_events();
 }
 } // namespace externis